@@ -4,6 +4,7 @@
 
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <functional>
+#include <iostream>
 #include <thread>
 #include <chrono>
 #include <set>
@@ -69,6 +70,9 @@ void printHelp()
     cout<<"   --port <port number>"<<endl;
     cout<<"   --host (server address)"<<endl;
     cout<<"   --server (run as server)"<<endl;
+    cout<<"   --batch <datagrams per syscall>"<<endl;
+    cout<<"   --io-uring (use the io_uring backend if available)"<<endl;
+    cout<<"   --gso (use UDP segmentation offload if available)"<<endl;
     throw "Exiting";
 }
 
@@ -81,9 +85,11 @@ void sendMessage()
 
     if (count < primitive_count)
     {
-        auto& b = *(*g_connections.begin())->send(true); // Create new reliable packet
+        auto c = *g_connections.begin();
+        auto& b = c->beginMessage();
         b<<(unsigned char)MessageHeader::Primitive;
         b<<true<<false<<std::string("testing, testing")<<2457544<<2334.53344f;
+        c->endMessage(true); // Packed with the other reliable messages
     }
     else if (count < reliable_count)
     {
@@ -91,9 +97,11 @@ void sendMessage()
         if (count == reliable_count-3) g_replicated_data.mInt.set(10); // Same value is not sent twice
         if (count == reliable_count-2) g_replicated_data.mInt.set(11);
 
-        auto& b = *(*g_connections.begin())->send(true); // Create new reliable packet
+        auto c = *g_connections.begin();
+        auto& b = c->beginMessage();
         b<<(unsigned char)MessageHeader::Replicated;
         b<<g_replicated_data;
+        c->endMessage(true);
     }
     else
     {
@@ -114,36 +122,39 @@ void receiveMessage()
         {
             auto& b = *buff;
 
-            std::cout<<__PRETTY_FUNCTION__<<std::endl;
-
-            unsigned char packetHeader;
-            b>>packetHeader; // Read packet type
-
-            switch ((MessageHeader)packetHeader)
+            while (b.nextMessage()) // One message at a time, read in place
             {
-                case MessageHeader::Primitive:
-                {
-                    bool bool1;
-                    bool bool2;
-                    std::string string1;
-                    int int1;
-                    float float1;
-                    
-                    b>>bool1>>bool2>>string1>>int1>>float1;
+                std::cout<<__PRETTY_FUNCTION__<<std::endl;
 
-                    cout<<bool1<<endl;
-                    cout<<bool2<<endl;
-                    cout<<string1<<endl;
-                    cout<<int1<<endl;
-                    cout<<float1<<endl;
+                unsigned char packetHeader;
+                b>>packetHeader; // Read packet type
 
-                    break;
-                }
-                case MessageHeader::Replicated:
+                switch ((MessageHeader)packetHeader)
                 {
-                    cout<<"received replicated"<<endl;
-                    b>>g_replicated_data;
-                    break;
+                    case MessageHeader::Primitive:
+                    {
+                        bool bool1;
+                        bool bool2;
+                        std::string string1;
+                        int int1;
+                        float float1;
+                    
+                        b>>bool1>>bool2>>string1>>int1>>float1;
+
+                        cout<<bool1<<endl;
+                        cout<<bool2<<endl;
+                        cout<<string1<<endl;
+                        cout<<int1<<endl;
+                        cout<<float1<<endl;
+
+                        break;
+                    }
+                    case MessageHeader::Replicated:
+                    {
+                        cout<<"received replicated"<<endl;
+                        b>>g_replicated_data;
+                        break;
+                    }
                 }
             }
         }
@@ -156,6 +167,9 @@ int main(int argc, char** argv)
     bool server = false;
     std::string port("0");
     std::string host("0");
+    unsigned batchSize = 1;
+    bool ioUring = false;
+    bool gso = false;
 
     if (argc <= 1) printHelp();
 
@@ -165,6 +179,9 @@ int main(int argc, char** argv)
         if (!strcmp(argv[i], "--server")) server = true;
         else if (!strcmp(argv[i], "--port") && ++i < argc) port = argv[i];
         else if (!strcmp(argv[i], "--host") && ++i < argc) host = argv[i];
+        else if (!strcmp(argv[i], "--batch") && ++i < argc) batchSize = atoi(argv[i]);
+        else if (!strcmp(argv[i], "--io-uring")) ioUring = true;
+        else if (!strcmp(argv[i], "--gso")) gso = true;
         else printHelp();
     }
 
@@ -181,6 +198,9 @@ int main(int argc, char** argv)
         std::bind(&onDisconnection, std::placeholders::_1),
         milliseconds.count(), server ? atoi(port.c_str()) : 0);
 
+    network.setBatchSize(batchSize);
+    if (ioUring && !network.setIoUring(true)) cout<<"io_uring is not available"<<endl;
+    if (gso && !network.setSegmentationOffload(true)) cout<<"UDP segmentation offload is not available"<<endl;
     cout<<network.getStatus()<<endl;
 
     // Connect to the server if we are a client
@@ -0,0 +1,115 @@
+#include "../udpnetwork_Socket.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using std::cout;
+using std::endl;
+
+
+// Send 'packetCount' datagrams through the loopback interface in rounds of
+// 'roundSize' datagrams and receive them back, return the packets per second.
+double run(unsigned batchSize, bool ioUring, bool gso, unsigned packetCount, unsigned roundSize, unsigned payloadSize)
+{
+    boost::asio::io_service ioService;
+    boost::asio::ip::udp::endpoint loopback(boost::asio::ip::address_v4::loopback(), 0);
+
+    udp_network::Socket sender(ioService, loopback);
+    udp_network::Socket receiver(ioService, loopback);
+    sender.setBatchSize(batchSize);
+    receiver.setBatchSize(batchSize);
+    if (ioUring && (!sender.setIoUring(true) || !receiver.setIoUring(true))) return 0;
+    if (gso && (!sender.setSegmentationOffload(true) || !receiver.setSegmentationOffload(true))) return 0;
+
+    boost::asio::ip::udp::endpoint destination = receiver.getLocalEndpoint();
+
+    std::vector<udp_network::Buffer> outgoing(roundSize);
+    for (auto& b : outgoing)
+    {
+        b.setType(udp_network::PT_DATA);
+        while (b.size() < payloadSize) b.writeByte(42);
+    }
+
+    std::vector<udp_network::Buffer*> incoming;
+    for (unsigned i = 0; i < batchSize; i++) incoming.push_back(new udp_network::Buffer());
+    std::vector<boost::asio::ip::udp::endpoint> endpoints(batchSize);
+
+    unsigned sent = 0;
+    unsigned received = 0;
+    auto startTime = std::chrono::high_resolution_clock::now();
+
+    while (sent < packetCount)
+    {
+        for (unsigned i = 0; i < roundSize && sent < packetCount; i++, sent++)
+        {
+            sender.send(outgoing[i], destination);
+        }
+        sender.flush();
+
+        // Drain the round, datagrams dropped by the kernel are not waited for
+        unsigned idle = 0;
+        while (received < sent && idle < 1000)
+        {
+            std::size_t n = receiver.receive(&incoming[0], &endpoints[0], batchSize);
+            if (n) idle = 0;
+            else ++idle;
+            received += n;
+        }
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - startTime;
+    for (auto b : incoming) delete b;
+    if (received != sent) cout<<"  (dropped "<<sent - received<<" datagrams)"<<endl;
+    return received / elapsed.count();
+}
+
+
+int main(int argc, char** argv)
+{
+    unsigned packetCount = 500000;
+    unsigned payloadSize = 64;
+    unsigned roundSize = 256;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--packets") && ++i < argc) packetCount = atoi(argv[i]);
+        else if (!strcmp(argv[i], "--size") && ++i < argc) payloadSize = atoi(argv[i]);
+        else if (!strcmp(argv[i], "--round") && ++i < argc) roundSize = atoi(argv[i]);
+        else
+        {
+            cout<<"Option:"<<endl;
+            cout<<"   --packets <number of datagrams>"<<endl;
+            cout<<"   --size <datagram size>"<<endl;
+            cout<<"   --round <datagrams sent before receiving>"<<endl;
+            return 1;
+        }
+    }
+
+    if (payloadSize > udp_network::Buffer::Size - 2) payloadSize = udp_network::Buffer::Size - 2;
+
+    cout<<"Sending "<<packetCount<<" datagrams of "<<payloadSize<<" bytes over loopback"<<endl;
+
+    double reference = 0;
+    for (unsigned batchSize : {1, 8, 32, 64, 128})
+    {
+        double pps = run(batchSize, false, false, packetCount, roundSize, payloadSize);
+        if (batchSize == 1) reference = pps;
+
+        cout<<"batch size "<<batchSize<<": "<<(unsigned long)pps<<" packets/s";
+        if (batchSize == 1) cout<<" (send_to/receive_from)"<<endl;
+        else cout<<" (x"<<pps / reference<<")"<<endl;
+    }
+
+    double pps = run(128, true, false, packetCount, roundSize, payloadSize);
+    if (pps) cout<<"io_uring: "<<(unsigned long)pps<<" packets/s (x"<<pps / reference<<")"<<endl;
+    else cout<<"io_uring: not available"<<endl;
+
+    pps = run(128, false, true, packetCount, roundSize, payloadSize);
+    if (pps) cout<<"GSO/GRO: "<<(unsigned long)pps<<" packets/s (x"<<pps / reference<<")"<<endl;
+    else cout<<"GSO/GRO: not available"<<endl;
+
+    return 0;
+}
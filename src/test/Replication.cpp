@@ -0,0 +1,479 @@
+#include "../udpnetwork_CongestionControl.h"
+#include "../udpnetwork_Connection.h"
+#include "../udpnetwork_Network.h"
+#include "../utils/InterestManager.h"
+#include "../utils/ReplicatedArray.h"
+#include "../utils/ReplicatedStruct.h"
+#include "../utils/ReplicatedVariable.h"
+#include "../utils/ReplicationManager.h"
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <iostream>
+#include <thread>
+
+using std::cout;
+using std::endl;
+using namespace udp_network;
+
+
+int g_errors = 0;
+
+#define CHECK(x) do { if (!(x)) { cout << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; ++g_errors; } } while (0)
+
+unsigned long getTime()
+{
+    static auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// A snapshot written in a packet of the backlog must not be recorded with the
+// stale id of a pooled buffer, the baseline would move on an unrelated ack
+void testBaselineBacklog()
+{
+    Network server([](Connection*, const std::string&) { return true; }, [](Connection*) {}, getTime(), 45090);
+    unsigned received = 0;
+    server.setMessageCallback([&](Connection*, Buffer&) { ++received; });
+    Network client([](Connection*, const std::string&) { return true; }, [](Connection*) {}, getTime());
+
+    // Paced, a full window is held back instead of overflowing the socket
+    client.setCongestionControl([]() -> CongestionControl* { return new AimdCongestionControl(); });
+
+    ReplicationBaseline baseline;
+    client.setAckCallback([&](Connection*, PacketId id) { baseline.acked(id); });
+
+    Connection* c = client.connect("127.0.0.1", "45090");
+    auto exchange = [&](int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            client.update(getTime());
+            server.update(getTime());
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    };
+    auto exchangeUntil = [&](const std::function<bool()>& done)
+    {
+        unsigned long start = getTime();
+        while (!done() && getTime() - start < 10000) exchange(1);
+    };
+    exchangeUntil([&]() { return c->isConnected(); });
+    CHECK(c->isConnected());
+
+    // Fill the pool with buffers that had an id, more than the window takes
+    // back, a packet per message
+    std::vector<byte> payload(Buffer::MaxMessageSize, 0);
+    auto sendWindow = [&]()
+    {
+        for (unsigned i = 0; i < Connection::ReliableWindow; i++) c->sendMessage(payload.data(), payload.size(), true);
+    };
+    unsigned expected = 0;
+    auto acked = [&]() { return received == expected && c->getBytesInFlight() == 0; };
+    sendWindow();
+    sendWindow();
+    expected += 2 * Connection::ReliableWindow;
+    exchangeUntil(acked);
+    CHECK(acked());
+
+    // Window full, the server does not ack
+    sendWindow();
+    client.update(getTime());
+
+    ReplicatedVariableContainer container;
+    ReplicatedVariable<int>& value = container.add<int>(0);
+    value.set(1);
+
+    Buffer* b = c->send(true);
+    CHECK(!b->hasId());
+    uint32_t backlogSnapshot = container.send(*b, baseline);
+    baseline.sent(*b, backlogSnapshot);
+
+    expected += Connection::ReliableWindow + 1;
+    exchangeUntil(acked);
+    CHECK(acked());
+    CHECK(baseline.get() == 0); // Not recorded, the next delta holds it again
+
+    // Sent with an id, the baseline follows its ack
+    value.set(2);
+    b = c->send(true);
+    CHECK(b->hasId());
+    uint32_t snapshot = container.send(*b, baseline);
+    baseline.sent(*b, snapshot);
+    CHECK(baseline.get() == 0);
+
+    ++expected;
+    exchangeUntil(acked);
+    CHECK(snapshot > backlogSnapshot);
+    CHECK(baseline.get() == snapshot);
+
+    // The ids wrap through 0, a valid id once given
+    ReplicationBaseline wrapped;
+    Buffer packet;
+    packet.setId(0);
+    CHECK(packet.hasId());
+    wrapped.sent(packet, 7);
+    wrapped.acked(0);
+    CHECK(wrapped.get() == 7);
+}
+
+
+// Round trips of the dirty fields, below and above 32 fields (two mask words)
+void testReplicatedStruct()
+{
+    enum { Health, Speed, Team };
+    typedef ReplicatedStruct<int32_t, float, uint8_t> Player;
+
+    Player a(100, 1.5f, 2), b;
+    Buffer full;
+    a.encode(full);
+    CHECK(!a.isDirty());
+    full.rewind();
+    CHECK(b.decode(full) == Player::AllFields);
+    CHECK(b.get<Health>() == 100 && b.get<Speed>() == 1.5f && b.get<Team>() == 2);
+
+    // Same value, not dirty
+    a.set<Health>(100);
+    a.set<Speed>(3.f);
+    CHECK(a.getDirty() == Player::Mask(1) << Speed);
+
+    Buffer delta;
+    a.encode(delta);
+    delta.rewind();
+    CHECK(b.decode(delta) == Player::Mask(1) << Speed);
+    CHECK(b.get<Speed>() == 3.f && b.get<Health>() == 100);
+
+    // Per peer masks, the struct dirty bits are left alone
+    a.set<Team>(4);
+    Buffer peer;
+    a.encode(peer, Player::AllFields);
+    CHECK(a.getDirty() == Player::Mask(1) << Team);
+    Player c;
+    peer.rewind();
+    CHECK(c.decode(peer) == Player::AllFields);
+    CHECK(c.get<Health>() == 100 && c.get<Speed>() == 3.f && c.get<Team>() == 4);
+
+    typedef ReplicatedStruct<int, int, int, int, int, int, int, int, int, int, int, int, int, int, int, int, int,
+        int, int, int, int, int, int, int, int, int, int, int, int, int, int, int, int, int> Large;
+    Large x, y;
+    x.clearDirty();
+    x.set<0>(9);
+    x.set<33>(7);
+    Buffer large;
+    x.encode(large);
+    large.rewind();
+    CHECK(y.decode(large) == ((Large::Mask(1) << 33) | 1));
+    CHECK(y.get<0>() == 9 && y.get<33>() == 7 && y.get<32>() == 0);
+}
+
+
+// Changed runs only, split over limited buffers, and a size from the network
+// above the maximum is refused
+void testReplicatedArray()
+{
+    struct Position { float x, y, z; };
+    const std::size_t size = 1000;
+
+    ReplicatedArray<Position> a(size), b;
+    for (std::size_t i = 0; i < size; i++) a[i] = {float(i), 0.f, 0.f};
+
+    Buffer buffer(1 << 16);
+    CHECK(a.encode(buffer));
+    buffer.rewind();
+    b.decode(buffer);
+    CHECK(b.size() == size && memcmp(a.data(), b.data(), size * sizeof(Position)) == 0);
+
+    // A few changes, a small delta
+    a[3].y = 1.f;
+    a[4].y = 1.f;
+    a[999].z = 2.f;
+    CHECK(a.diff() == 3);
+    buffer.clear();
+    CHECK(a.encode(buffer));
+    CHECK(buffer.size() - PacketHeaderSize < 4 * sizeof(Position) + 16);
+    buffer.rewind();
+    b.decode(buffer);
+    CHECK(memcmp(a.data(), b.data(), size * sizeof(Position)) == 0);
+    CHECK(a.diff() == 0);
+
+    // More than a datagram, the rest goes with the next encodes
+    for (std::size_t i = 0; i < size; i += 3) a[i].x += 1.f;
+    int encodes = 0;
+    bool complete = false;
+    while (!complete && encodes < 100)
+    {
+        Buffer datagram;
+        complete = a.encode(datagram);
+        datagram.rewind();
+        b.decode(datagram);
+        ++encodes;
+    }
+    CHECK(encodes > 1);
+    CHECK(memcmp(a.data(), b.data(), size * sizeof(Position)) == 0);
+
+    // A size over the maximum is refused before anything is allocated
+    Buffer hostile;
+    hostile.writeVarUint(ReplicatedArray<Position>::DefaultMaxSize + 1);
+    hostile << uint16_t(0);
+    hostile.rewind();
+    ReplicatedArray<Position> c;
+    bool threw = false;
+    try { c.decode(hostile); } catch (std::runtime_error&) { threw = true; }
+    CHECK(threw && c.size() == 0);
+
+    c.setMaxSize(size - 1);
+    buffer.clear();
+    a.force();
+    a.encode(buffer);
+    buffer.rewind();
+    threw = false;
+    try { c.decode(buffer); } catch (std::runtime_error&) { threw = true; }
+    CHECK(threw && c.size() == 0);
+}
+
+
+// Per peer baselines: a lost run is written again until acked, whatever was
+// sent to the other peers, and a reordered run older than the received one is skipped
+void testReplicatedArrayPeers()
+{
+    const std::size_t size = 100;
+    ReplicatedArray<int32_t> a(size), b, c;
+    ReplicatedArrayBaseline peerB, peerC;
+    auto decoded = [&](ReplicatedArray<int32_t>& x) { return memcmp(a.data(), x.data(), size * sizeof(int32_t)) == 0; };
+
+    // Everything to both, acked
+    Buffer full;
+    CHECK(a.encode(full, peerB));
+    peerB.sent(1);
+    full.rewind();
+    b.decode(full);
+    peerB.acked(1);
+    full.clear();
+    CHECK(a.encode(full, peerC));
+    peerC.sent(1);
+    full.rewind();
+    c.decode(full);
+    peerC.acked(1);
+    CHECK(decoded(b) && decoded(c));
+
+    // Lost for B, received by C
+    a[10] = 1;
+    Buffer lost, toC;
+    a.encode(lost, peerB);
+    peerB.sent(2);
+    a.encode(toC, peerC);
+    peerC.sent(2);
+    toC.rewind();
+    c.decode(toC);
+    peerC.acked(2);
+    CHECK(decoded(c));
+
+    // Written again for B only
+    a[20] = 2;
+    Buffer again, onlyNew;
+    a.encode(again, peerB);
+    peerB.sent(3);
+    a.encode(onlyNew, peerC);
+    CHECK(again.size() > onlyNew.size());
+    again.rewind();
+    b.decode(again);
+    peerB.acked(3);
+    CHECK(decoded(b));
+
+    // Acked, nothing left
+    Buffer empty;
+    a.encode(empty, peerB);
+    uint16_t count = 1;
+    empty.rewind();
+    empty.readVarUint();
+    empty.readVarUint();
+    empty >> count;
+    CHECK(count == 0);
+
+    // The lost packet arrives late, after a newer value
+    a[10] = 3;
+    Buffer newer;
+    a.encode(newer, peerB);
+    newer.rewind();
+    b.decode(newer);
+    lost.rewind();
+    b.decode(lost);
+    CHECK(b[10] == 3);
+}
+
+
+// Enter within the radius, leave past the leave radius, across cells
+void testInterestManager()
+{
+    int observer = 0;
+    Connection* c = (Connection*)&observer; // Only a key
+    std::vector<ObjectId> entered, left;
+
+    InterestManager interest(10.f);
+    interest.addObserver(c, 20.f, 30.f);
+    interest.add(1, 5.f, 5.f);
+    interest.add(2, 25.f, 0.f);   // Between the radius and the leave radius
+    interest.add(3, -100.f, 0.f);
+    interest.addGlobal(4);
+
+    interest.update(c, entered, left);
+    CHECK((entered == std::vector<ObjectId>{1, 4}));
+    CHECK(left.empty());
+
+    // Moved within the leave radius, still relevant
+    interest.move(1, 25.f, 5.f);
+    interest.move(3, -15.f, 0.f);
+    interest.update(c, entered, left);
+    CHECK((entered == std::vector<ObjectId>{3}));
+    CHECK(left.empty());
+    CHECK(interest.isRelevant(c, 1));
+
+    // Past it
+    interest.move(1, 31.f, 0.f);
+    interest.update(c, entered, left);
+    CHECK(entered.empty());
+    CHECK((left == std::vector<ObjectId>{1}));
+
+    // The observer moves, the relevancy callback filters
+    interest.setRelevancyCallback([](Connection*, ObjectId id) { return id != 4; });
+    interest.setObserverPosition(c, 30.f, 0.f);
+    interest.update(c, entered, left);
+    CHECK((entered == std::vector<ObjectId>{1, 2}));
+    CHECK((left == std::vector<ObjectId>{3, 4}));
+    CHECK((interest.getRelevant(c) == std::vector<ObjectId>{1, 2}));
+
+    interest.remove(2);
+    interest.update(c, entered, left);
+    CHECK((left == std::vector<ObjectId>{2}));
+    CHECK(!interest.contains(2) && interest.getObjectCount() == 3);
+
+    interest.removeObserver(c);
+    bool threw = false;
+    try { interest.update(c, entered, left); } catch (std::runtime_error&) { threw = true; }
+    CHECK(threw);
+}
+
+
+enum { UnitType = 7 };
+
+class Unit : public ReplicatedEntity
+{
+public:
+    Unit() : ReplicatedEntity(UnitType), mX(add<int>(0)) {}
+    ReplicatedVariable<int>& mX;
+};
+
+// Spawns and despawns within the budget, by priority, and across interest changes
+void testReplicationManager()
+{
+    ReplicationManager serverManager, clientManager;
+    Connection* serverConnection = nullptr;
+    Network server([&](Connection* c, const std::string&) { serverConnection = c; serverManager.addConnection(c); return true; },
+        [&](Connection* c) { serverManager.removeConnection(c); }, getTime(), 45091);
+    Network client([](Connection*, const std::string&) { return true; }, [&](Connection* c) { clientManager.removeConnection(c); }, getTime());
+
+    std::map<ObjectId, Unit*> remote;
+    int despawns = 0;
+    clientManager.setSpawnCallback([&](Connection*, ObjectId id, EntityType type) -> ReplicatedEntity* {
+        CHECK(type == UnitType);
+        return remote[id] = new Unit;
+    });
+    clientManager.setDespawnCallback([&](Connection*, ReplicatedEntity* e) {
+        ++despawns;
+        remote.erase(e->getId());
+        delete e;
+    });
+    client.setMessageCallback([&](Connection* c, Buffer& b) { CHECK(clientManager.receive(c, b)); });
+
+    Connection* c = client.connect("127.0.0.1", "45091");
+    auto tick = [&](int count)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            serverManager.update();
+            server.update(getTime());
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            client.update(getTime());
+        }
+    };
+    unsigned long start = getTime();
+    while ((!c->isConnected() || !serverConnection) && getTime() - start < 5000) tick(1);
+    CHECK(serverConnection);
+    if (!serverConnection) return;
+
+    // A few spawns per tick, the most important first
+    serverManager.setBudget(64);
+    std::vector<Unit*> units;
+    for (int i = 0; i < 20; i++)
+    {
+        units.push_back(new Unit);
+        units.back()->mX.set(i);
+        serverManager.spawn(units.back());
+    }
+    units.back()->setPriority(100);
+
+    tick(1);
+    CHECK(!remote.empty() && remote.size() < units.size() / 2);
+    CHECK(remote.count(units.back()->getId()));
+
+    tick(20);
+    CHECK(remote.size() == units.size());
+    for (auto u : units) CHECK(remote.count(u->getId()) && remote[u->getId()]->mX.get() == u->mX.get());
+
+    // Despawns too
+    serverManager.setBudget(16);
+    for (int i = 0; i < 10; i++)
+    {
+        serverManager.despawn(units.back());
+        delete units.back();
+        units.pop_back();
+    }
+    tick(1);
+    CHECK(despawns > 0 && despawns < 5);
+    tick(10);
+    CHECK(despawns == 10 && remote.size() == units.size());
+
+    // Out of range despawned, spawned back when in range with its current state
+    serverManager.setBudget(0);
+    InterestManager interest(10.f);
+    interest.addObserver(serverConnection, 20.f);
+    serverManager.setInterestManager(&interest);
+    for (std::size_t i = 0; i < units.size(); i++) interest.add(units[i]->getId(), float(i * 100), 0.f);
+    tick(5);
+    CHECK(remote.size() == 1 && remote.count(units[0]->getId()));
+
+    interest.move(units[0]->getId(), 500.f, 0.f);
+    interest.move(units[1]->getId(), 5.f, 0.f);
+    units[0]->mX.set(77);
+    tick(5);
+    CHECK(remote.size() == 1 && remote.count(units[1]->getId()));
+
+    interest.move(units[0]->getId(), 0.f, 0.f);
+    tick(5);
+    CHECK(remote.size() == 2 && remote.count(units[0]->getId()) && remote[units[0]->getId()]->mX.get() == 77);
+
+    for (auto u : units)
+    {
+        serverManager.despawn(u);
+        delete u;
+    }
+    tick(5);
+    CHECK(remote.empty());
+    client.disconnect(c);
+}
+
+
+int main()
+{
+    testBaselineBacklog();
+    testReplicatedStruct();
+    testReplicatedArray();
+    testReplicatedArrayPeers();
+    testInterestManager();
+    testReplicationManager();
+
+    cout << (g_errors ? "FAILED" : "OK") << endl;
+    return g_errors ? 1 : 0;
+}
@@ -0,0 +1,292 @@
+#include "../udpnetwork_CongestionControl.h"
+#include "../udpnetwork_Connection.h"
+#include "../udpnetwork_Network.h"
+#include "../udpnetwork_ShardedNetwork.h"
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <thread>
+
+using std::cout;
+using std::endl;
+using namespace udp_network;
+using boost::asio::ip::udp;
+
+
+int g_errors = 0;
+
+#define CHECK(x) do { if (!(x)) { cout << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; ++g_errors; } } while (0)
+
+unsigned long getTime()
+{
+    static auto start = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// Between a client and a server, drops and reorders the datagrams both ways
+class LossyProxy
+{
+public:
+    LossyProxy(unsigned short port, unsigned short serverPort, unsigned dropPercent, unsigned reorderPercent)
+    :   mClientSide(mIoService, udp::endpoint(udp::v4(), port)),
+        mServerSide(mIoService, udp::endpoint(udp::v4(), 0)),
+        mServer(boost::asio::ip::address::from_string("127.0.0.1"), serverPort),
+        mDropPercent(dropPercent), mReorderPercent(reorderPercent), mSeed(42), mDropped(0), mReordered(0)
+    {
+        // Bursts of a full window
+        mClientSide.set_option(udp::socket::receive_buffer_size(8 * 1024 * 1024));
+        mServerSide.set_option(udp::socket::receive_buffer_size(8 * 1024 * 1024));
+    }
+
+    void update()
+    {
+        forward(mClientSide, mServerSide, mServer, mHeldToServer, &mClient);
+        if (mClient.port()) forward(mServerSide, mClientSide, mClient, mHeldToClient, nullptr);
+    }
+
+    // A new address towards the server, as a NAT rebinding
+    void rebind()
+    {
+        mServerSide = udp::socket(mIoService, udp::endpoint(udp::v4(), 0));
+        mServerSide.set_option(udp::socket::receive_buffer_size(8 * 1024 * 1024));
+    }
+
+    unsigned short getPort() { return mClientSide.local_endpoint().port(); }
+    unsigned getDropped() { return mDropped; }
+    unsigned getReordered() { return mReordered; }
+
+private:
+    // Held datagrams go out after the next one. A link queueing past its rate, a few at a
+    // time not to overflow the socket of the peer with a window of resent packets
+    void forward(udp::socket& from, udp::socket& to, const udp::endpoint& target, std::vector<char>& held, udp::endpoint* sender)
+    {
+        char data[2048];
+        for (int i = 0; i < 64 && from.available(); i++)
+        {
+            udp::endpoint e;
+            std::size_t size = from.receive_from(boost::asio::buffer(data), e);
+            if (sender) *sender = e;
+
+            unsigned r = random() % 100;
+            if (r < mDropPercent)
+            {
+                ++mDropped;
+                continue;
+            }
+            if (held.empty() && r < mDropPercent + mReorderPercent)
+            {
+                held.assign(data, data + size);
+                ++mReordered;
+                continue;
+            }
+
+            to.send_to(boost::asio::buffer(data, size), target);
+            if (!held.empty())
+            {
+                to.send_to(boost::asio::buffer(held), target);
+                held.clear();
+            }
+        }
+    }
+
+    unsigned random()
+    {
+        mSeed = mSeed * 1103515245 + 12345; // Same losses on every run
+        return mSeed >> 16;
+    }
+
+    boost::asio::io_service mIoService;
+    udp::socket mClientSide;
+    udp::socket mServerSide;
+    udp::endpoint mClient;
+    udp::endpoint mServer;
+    std::vector<char> mHeldToServer;
+    std::vector<char> mHeldToClient;
+    unsigned mDropPercent;
+    unsigned mReorderPercent;
+    uint32_t mSeed;
+    unsigned mDropped;
+    unsigned mReordered;
+};
+
+
+// Connected through the proxy, the proxy updated between the networks
+struct LossyPath
+{
+    LossyPath(unsigned short port, unsigned dropPercent, unsigned reorderPercent)
+    :   server([](Connection*, const std::string&) { return true; }, [](Connection*) {}, getTime(), port),
+        client([](Connection*, const std::string&) { return true; }, [](Connection*) {}, getTime()),
+        proxy(port + 1, port, dropPercent, reorderPercent),
+        connection(nullptr)
+    {}
+
+    void connect()
+    {
+        connection = client.connect("127.0.0.1", std::to_string(proxy.getPort()));
+        exchangeUntil([&]() { return connection->isConnected(); }, 5000);
+        CHECK(connection->isConnected());
+    }
+
+    void exchange()
+    {
+        client.update(getTime());
+        proxy.update();
+        server.update(getTime());
+        proxy.update();
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+
+    bool exchangeUntil(const std::function<bool()>& done, unsigned long timeout)
+    {
+        unsigned long start = getTime();
+        while (!done() && getTime() - start < timeout) exchange();
+        return done();
+    }
+
+    Network server;
+    Network client;
+    LossyProxy proxy;
+    Connection* connection;
+};
+
+
+// Paced by the congestion control, the losses must not stall the window: the
+// packets held back by the pacing have no ack coming to send them
+void testLossyDelivery()
+{
+    LossyPath path(45092, 1, 0);
+    path.client.setCongestionControl([]() -> CongestionControl* { return new AimdCongestionControl(); });
+
+    const unsigned count = 5000;
+    unsigned received = 0;
+    bool ordered = true;
+    path.server.setMessageCallback([&](Connection*, Buffer& b)
+    {
+        uint32_t i = 0;
+        b >> i;
+        ordered = ordered && i == received;
+        ++received;
+    });
+    path.connect();
+
+    std::vector<byte> message(600, 0);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        memcpy(message.data(), &i, sizeof(i));
+        path.connection->sendMessage(message.data(), message.size(), true);
+    }
+
+    unsigned long start = getTime();
+    path.exchangeUntil([&]() { return received == count; }, 20000);
+    cout << "lossy: " << received << "/" << count << " in " << getTime() - start << " ms, "
+         << path.proxy.getDropped() << " dropped" << endl;
+    CHECK(received == count);
+    CHECK(ordered);
+    CHECK(path.proxy.getDropped() > 0);
+}
+
+
+// Reliable ids wrapping past 65535, through losses and reordering: with a full window in
+// flight, the held early packets go past the 32 ack bits and 'Connection::MaxEarlyPackets'
+void testReliableWraparound()
+{
+    LossyPath path(45096, 1, 5);
+
+    const unsigned count = 70000; // Reliable ids wrap once
+    unsigned received = 0;
+    bool ordered = true;
+    path.server.setMessageCallback([&](Connection*, Buffer& b)
+    {
+        uint32_t i = 0;
+        b >> i;
+        ordered = ordered && i == received;
+        ++received;
+    });
+    path.connect();
+
+    // A packet per message, a few windows queued at most
+    std::vector<byte> message(600, 0);
+    uint32_t sent = 0;
+    unsigned long start = getTime();
+    path.exchangeUntil([&]()
+    {
+        for (; sent < count && sent - received < 4 * Connection::ReliableWindow; sent++)
+        {
+            memcpy(message.data(), &sent, sizeof(sent));
+            path.connection->sendMessage(message.data(), message.size(), true);
+        }
+        return received == count;
+    }, 60000);
+    path.exchangeUntil([&]() { return path.connection->getBytesInFlight() == 0; }, 5000); // The last acks
+
+    cout << "wraparound: " << received << "/" << count << " in " << getTime() - start << " ms, "
+         << path.proxy.getDropped() << " dropped, " << path.proxy.getReordered() << " reordered" << endl;
+    CHECK(received == count);
+    CHECK(ordered);
+    CHECK(path.connection->getBytesInFlight() == 0);
+}
+
+
+// Routed by their connection id, the datagrams of a connection changing address
+// still reach its shard whatever the hash of the new address
+void testShardedMigration()
+{
+    std::atomic<unsigned> received(0);
+    ShardedNetwork server(
+        [](Connection*, const std::string&) { return true; },
+        [](Connection*) {},
+        [&](Connection*, Buffer&) { ++received; },
+        45094, 4, 5);
+    CHECK(server.isSteered());
+    server.start();
+
+    Network client([](Connection*, const std::string&) { return true; }, [](Connection*) {}, getTime());
+    LossyProxy proxy(45095, 45094, 0, 0);
+    auto exchange = [&]()
+    {
+        client.update(getTime());
+        proxy.update();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    };
+    auto exchangeUntil = [&](const std::function<bool()>& done, unsigned long timeout)
+    {
+        unsigned long start = getTime();
+        while (!done() && getTime() - start < timeout) exchange();
+    };
+
+    Connection* c = client.connect("127.0.0.1", "45095");
+    exchangeUntil([&]() { return c->isConnected(); }, 5000);
+    CHECK(c->isConnected());
+
+    // A packet per update, on more addresses than shards
+    unsigned sent = 0;
+    for (int address = 0; address < 8; address++)
+    {
+        if (address) proxy.rebind();
+        for (int i = 0; i < 20; i++)
+        {
+            *c->send(true) << uint32_t(sent++);
+            exchange();
+        }
+        exchangeUntil([&]() { return received == sent; }, 3000);
+        CHECK(received == sent);
+    }
+    CHECK(c->isConnected());
+    server.stop();
+}
+
+
+int main()
+{
+    testLossyDelivery();
+    testReliableWraparound();
+    testShardedMigration();
+
+    cout << (g_errors ? "FAILED" : "OK") << endl;
+    return g_errors ? 1 : 0;
+}
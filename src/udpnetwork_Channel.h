@@ -0,0 +1,61 @@
+#pragma once
+
+#include "udpnetwork_Packet.h"
+
+#include <vector>
+
+namespace udp_network
+{
+
+enum ChannelType
+{
+    CT_RELIABLE_ORDERED,     // Delivered once, in the channel order
+    CT_RELIABLE_UNORDERED,   // Delivered once, as received
+    CT_UNRELIABLE_SEQUENCED, // Packets older than the last delivered are dropped
+    CT_UNRELIABLE,
+};
+
+typedef byte ChannelId;
+
+// Configured on every network, the others are added with 'Network::addChannel'
+const ChannelId DefaultReliableChannel = 0;   // Reliable ordered, 'send(true)'
+const ChannelId DefaultUnreliableChannel = 1; // Unreliable, 'send(false)'
+
+// Per connection state of a channel. Every channel has its own sequence, a
+// lost packet only holds back the following packets of its channel.
+// The buffers are released by the connection.
+struct Channel
+{
+    Channel()
+    :   type(CT_UNRELIABLE), sequence(0), writing(nullptr), receivedSequence(0),
+        reassembly(nullptr), reassemblySize(0), reassemblyTime(0) {}
+
+    // The buffers must have been released, the ring is kept
+    void reset(ChannelType t)
+    {
+        type = t;
+        sequence = 0;
+        writing = nullptr;
+        receivedSequence = 0;
+        reassembly = nullptr;
+        reassemblySize = 0;
+        reassemblyTime = 0;
+    }
+
+    bool isReliable() const { return type == CT_RELIABLE_ORDERED || type == CT_RELIABLE_UNORDERED; }
+
+    ChannelType type;
+
+    // Send
+    PacketId sequence;  // Last given
+    Buffer* writing;    // Last packet, written until sent
+
+    // Receive
+    PacketId receivedSequence;  // Last delivered in order, or the latest (sequenced)
+    std::vector<Buffer*> early; // Ordered, waiting for the previous packets. Ring indexed by sequence % size
+    Buffer* reassembly;         // Fragmented message, ordered only
+    uint32_t reassemblySize;
+    unsigned reassemblyTime;    // Last fragment received
+};
+
+} // udp_network
@@ -11,7 +11,15 @@ typedef unsigned char byte;
 inline std::size_t hash_endpoint(const boost::asio::ip::udp::endpoint& e)
 {
     std::size_t h = 0;
-    boost::hash_combine(h, e.address().to_v4().to_ulong());
+    if (e.address().is_v4())
+    {
+        boost::hash_combine(h, e.address().to_v4().to_ulong());
+    }
+    else
+    {
+        auto bytes = e.address().to_v6().to_bytes();
+        boost::hash_range(h, bytes.begin(), bytes.end());
+    }
     boost::hash_combine(h, e.port());
     return h;
 }
@@ -21,19 +29,11 @@ inline std::size_t hash_endpoint(const boost::asio::ip::udp::endpoint& e)
 namespace std
 {
 
+// NOTE: equality is the endpoint operator==, not the hash
 template<>
-struct hash<boost::asio::ip::udp::endpoint> : public unary_function<boost::asio::ip::udp::endpoint, size_t>
+struct hash<boost::asio::ip::udp::endpoint>
 {
     std::size_t operator() (const boost::asio::ip::udp::endpoint& e) const { return udp_network::hash_endpoint(e); }
 };
 
-template<>
-struct equal_to<boost::asio::ip::udp::endpoint> : public unary_function<boost::asio::ip::udp::endpoint,size_t>
-{
-    bool operator() (const boost::asio::ip::udp::endpoint& e1, const boost::asio::ip::udp::endpoint& e2) const
-    {
-        return udp_network::hash_endpoint(e1) == udp_network::hash_endpoint(e2);
-    }
-};
-
 } // std
@@ -0,0 +1,177 @@
+#include "udpnetwork_CongestionControl.h"
+
+#include <algorithm>
+
+using namespace udp_network;
+
+const unsigned CongestionControl::PacketSize;
+const unsigned CongestionControl::InitialWindow;
+const unsigned BbrCongestionControl::BandwidthRounds;
+const unsigned BbrCongestionControl::MinRttExpiration;
+
+namespace
+{
+
+const float MaxWindow = 1 << 24;
+
+const float StartupGain = 2.89f; // 2 / ln(2), doubles the delivery rate each round
+const float ProbeWindowGain = 2.f;
+const float CycleGains[] = { 1.25f, 0.75f, 1.f, 1.f, 1.f, 1.f, 1.f, 1.f };
+const unsigned CycleLength = sizeof(CycleGains) / sizeof(CycleGains[0]);
+
+} // anonymous namespace
+
+
+/*
+ * AimdCongestionControl
+ */
+
+AimdCongestionControl::AimdCongestionControl()
+{
+    reset();
+}
+
+void AimdCongestionControl::reset()
+{
+    mWindow = InitialWindow;
+    mSlowStartThreshold = MaxWindow;
+    mSrtt = 0;
+    mLastReduction = 0;
+    bReduced = false;
+}
+
+void AimdCongestionControl::onAck(unsigned bytes, int rtt, unsigned bytesInFlight, unsigned currentTime)
+{
+    if (rtt >= 0) mSrtt = mSrtt ? 0.875f * mSrtt + 0.125f * rtt : std::max(rtt, 1);
+
+    // Application limited, the window was not used
+    if (bytesInFlight + bytes < mWindow / 2) return;
+
+    if (mWindow < mSlowStartThreshold) mWindow += bytes;
+    else mWindow += float(PacketSize) * bytes / mWindow;
+    mWindow = std::min(mWindow, MaxWindow);
+}
+
+void AimdCongestionControl::onLoss(unsigned bytesInFlight, unsigned currentTime)
+{
+    // The packets lost in the same round trip are a single congestion event
+    if (bReduced && currentTime - mLastReduction < std::max(mSrtt, 1.f)) return;
+
+    mSlowStartThreshold = std::max(mWindow / 2, 2.f * PacketSize);
+    mWindow = mSlowStartThreshold;
+    mLastReduction = currentTime;
+    bReduced = true;
+}
+
+unsigned AimdCongestionControl::getPacingRate()
+{
+    if (!mSrtt) return 0;
+    return 1.25f * mWindow * 1000 / mSrtt; // A bit faster than the window, to fill it
+}
+
+
+/*
+ * BbrCongestionControl
+ */
+
+BbrCongestionControl::BbrCongestionControl()
+{
+    reset();
+}
+
+void BbrCongestionControl::reset()
+{
+    mMode = STARTUP;
+    mMinRtt = ~0u;
+    mMinRttTime = 0;
+    bRoundStarted = false;
+    mRoundStart = 0;
+    mRoundBytes = 0;
+    std::fill(mBandwidthSamples, mBandwidthSamples + BandwidthRounds, 0);
+    mRound = 0;
+    mBandwidth = 0;
+    mFullBandwidth = 0;
+    mFullBandwidthRounds = 0;
+    mCycle = 0;
+}
+
+void BbrCongestionControl::onAck(unsigned bytes, int rtt, unsigned bytesInFlight, unsigned currentTime)
+{
+    if (rtt >= 0 && (unsigned(rtt) <= mMinRtt || currentTime - mMinRttTime > MinRttExpiration))
+    {
+        mMinRtt = rtt;
+        mMinRttTime = currentTime;
+    }
+
+    if (!bRoundStarted)
+    {
+        bRoundStarted = true;
+        mRoundStart = currentTime;
+    }
+
+    mRoundBytes += bytes;
+
+    unsigned roundLength = mMinRtt == ~0u ? 1 : std::max(mMinRtt, 1u);
+    if (currentTime - mRoundStart >= roundLength) onRound(bytesInFlight, currentTime);
+}
+
+void BbrCongestionControl::onRound(unsigned bytesInFlight, unsigned currentTime)
+{
+    mBandwidthSamples[mRound++ % BandwidthRounds] = uint64_t(mRoundBytes) * 1000 / (currentTime - mRoundStart);
+    mBandwidth = *std::max_element(mBandwidthSamples, mBandwidthSamples + BandwidthRounds);
+
+    mRoundBytes = 0;
+    mRoundStart = currentTime;
+
+    switch (mMode)
+    {
+        case STARTUP:
+            // Full once the bandwidth grew less than 25% for 3 rounds
+            if (mBandwidth >= mFullBandwidth * 1.25f)
+            {
+                mFullBandwidth = mBandwidth;
+                mFullBandwidthRounds = 0;
+            }
+            else if (++mFullBandwidthRounds >= 3) mMode = DRAIN;
+            break;
+
+        case DRAIN:
+            if (bytesInFlight <= getBdp())
+            {
+                mMode = PROBE_BANDWIDTH;
+                mCycle = 0;
+            }
+            break;
+
+        case PROBE_BANDWIDTH:
+            mCycle = (mCycle + 1) % CycleLength;
+            break;
+    }
+}
+
+unsigned BbrCongestionControl::getBdp()
+{
+    if (mMinRtt == ~0u) return 0;
+    return uint64_t(mBandwidth) * std::max(mMinRtt, 1u) / 1000;
+}
+
+unsigned BbrCongestionControl::getWindow()
+{
+    if (!mBandwidth) return InitialWindow;
+
+    float gain = mMode == STARTUP ? StartupGain : ProbeWindowGain;
+    return std::max<unsigned>(gain * getBdp(), 4 * PacketSize);
+}
+
+unsigned BbrCongestionControl::getPacingRate()
+{
+    if (!mBandwidth) return 0;
+
+    switch (mMode)
+    {
+        case STARTUP: return StartupGain * mBandwidth;
+        case DRAIN: return mBandwidth / StartupGain;
+        case PROBE_BANDWIDTH: return CycleGains[mCycle] * mBandwidth;
+    }
+    return mBandwidth;
+}
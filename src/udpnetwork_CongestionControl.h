@@ -0,0 +1,107 @@
+#pragma once
+
+#include "udpnetwork_Packet.h"
+
+namespace udp_network
+{
+
+// Per connection congestion controller, fed by the reliable layer.
+// The connection keeps its reliable bytes in flight under 'getWindow' and
+// spreads its reliable sends at 'getPacingRate'.
+class CongestionControl
+{
+public:
+    static const unsigned PacketSize = Buffer::Size;
+    static const unsigned InitialWindow = 10 * PacketSize;
+
+    virtual ~CongestionControl() {}
+
+    // Called when a pooled connection is reused
+    virtual void reset() = 0;
+
+    // 'rtt' is -1 when the packet was resent (not a valid sample)
+    virtual void onAck(unsigned bytes, int rtt, unsigned bytesInFlight, unsigned currentTime) = 0;
+
+    // A reliable packet timed out
+    virtual void onLoss(unsigned bytesInFlight, unsigned currentTime) = 0;
+
+    virtual unsigned getWindow() = 0;     // Bytes
+    virtual unsigned getPacingRate() = 0; // Bytes per second, 0 to send without pacing
+};
+
+// Slow start then one more packet per round trip, the window is halved
+// on loss (at most once per round trip).
+class AimdCongestionControl : public CongestionControl
+{
+public:
+    AimdCongestionControl();
+
+    void reset();
+    void onAck(unsigned bytes, int rtt, unsigned bytesInFlight, unsigned currentTime);
+    void onLoss(unsigned bytesInFlight, unsigned currentTime);
+
+    unsigned getWindow() { return mWindow; }
+    unsigned getPacingRate();
+
+protected:
+    float mWindow;
+    float mSlowStartThreshold;
+    float mSrtt;
+    unsigned mLastReduction;
+    bool bReduced;
+};
+
+// Model based, after BBR: the window and the pacing rate follow the
+// measured bottleneck bandwidth (max delivery rate over the last rounds)
+// and the minimum RTT instead of reacting to losses.
+//
+// Startup doubles the rate each round until the bandwidth stops growing,
+// drain empties the queue built meanwhile, then the rate is cycled around
+// the bandwidth estimate (probe up, drain, cruise).
+class BbrCongestionControl : public CongestionControl
+{
+public:
+    static const unsigned BandwidthRounds = 10;  // Max filter length
+    static const unsigned MinRttExpiration = 10000;
+
+    BbrCongestionControl();
+
+    void reset();
+    void onAck(unsigned bytes, int rtt, unsigned bytesInFlight, unsigned currentTime);
+    void onLoss(unsigned bytesInFlight, unsigned currentTime) {}
+
+    unsigned getWindow();
+    unsigned getPacingRate();
+
+    unsigned getBandwidth() { return mBandwidth; } // Bytes per second
+    unsigned getMinRtt() { return mMinRtt; } // ~0u until measured
+
+protected:
+    enum Mode
+    {
+        STARTUP,
+        DRAIN,
+        PROBE_BANDWIDTH,
+    };
+
+    void onRound(unsigned bytesInFlight, unsigned currentTime);
+    unsigned getBdp(); // Bytes
+
+    Mode mMode;
+    unsigned mMinRtt;
+    unsigned mMinRttTime;
+
+    // Delivery rate measured over rounds of about one min RTT
+    bool bRoundStarted;
+    unsigned mRoundStart;
+    unsigned mRoundBytes;
+    unsigned mBandwidthSamples[BandwidthRounds];
+    unsigned mRound;
+    unsigned mBandwidth;
+
+    unsigned mFullBandwidth; // Startup exit
+    unsigned mFullBandwidthRounds;
+    unsigned mCycle;         // Probe bandwidth gain index
+};
+
+} // udp_network
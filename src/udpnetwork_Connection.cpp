@@ -1,217 +1,896 @@
 #include "udpnetwork_Connection.h"
 #include "udpnetwork_Network.h"
+#include "udpnetwork_Socket.h"
+#include "udpnetwork_Log.h"
+#include "udpnetwork_Trace.h"
 
-#include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <sstream>
+#include <stdexcept>
 
 using namespace udp_network;
 
-Connection::Connection(Network* network, const boost::asio::ip::udp::endpoint& endpoint, unsigned currentTime)
-:   mNetwork(network), mEndpoint(endpoint),
-    mPing(0), mReliableID(0), mUnreliableID(0),
+const PacketId Connection::ReliableWindow;
+const unsigned Connection::MaxEarlyPackets;
+const unsigned Connection::InitialRto;
+const unsigned Connection::MinRto;
+const unsigned Connection::MaxRto;
+const unsigned Connection::PacingHorizon;
+const std::size_t Connection::MaxFragmentedMessageSize;
+const std::size_t Connection::MaxReassemblySize;
+const unsigned Connection::ReassemblyTimeout;
+const unsigned Connection::MtuProbeCount;
+const unsigned Connection::MtuSearchGranularity;
+const unsigned Connection::MtuSearchInterval;
+
+Connection::Connection(Network* network, ConnectionState* state)
+:   mState(state), mNetwork(network), mSecret(0), mChallenge(0), mChallengeTime(0), mEarlyCount(0), mReassemblySize(0),
+    mReceivedReliableBits(0), bPendingAck(false),
+    mSrtt(0), mRttVar(0), mRto(InitialRto), bRttMeasured(false), bWaitingPong(false),
+    mCongestionControl(nullptr), mBytesInFlight(0), mPacingCredit(0), mPacingTime(0),
+    mNextDeparture(0), mNextSendTime(0), bWindowFull(false), bLost(false),
+    mSendTick(0), mSendBudget(0), mDeferredBytes(0), bDeferred(false),
+    bMtuDiscovery(false), mMtu(Buffer::Size), mMtuMax(Buffer::MaxSize), mMtuProbe(0), mMtuProbeCount(0), mMtuProbeTime(0),
+    mReliableID(0), mFirstUnackedID(1), mUnreliableID(0),
     mReceivedReliableID(0), mReceivedUnreliableID(0),
-    mSentTime(currentTime), mPingSentTime(currentTime),
-    mHeartbeat(currentTime), mIsConnected(false), mUserData(0)
-{}
+    mUserData(0)
+{
+    mState->connection = this;
+    mState->timer.owner = mState;
+}
 
 Connection::~Connection()
 {
     clear();
+    recycle();
+    delete mCongestionControl;
+}
+
+void Connection::reset(const boost::asio::ip::udp::endpoint& endpoint, unsigned currentTime)
+{
+    mEndpoint = endpoint;
+    mSrtt = 0;
+    mRttVar = 0;
+    mRto = InitialRto;
+    bRttMeasured = false;
+    bWaitingPong = false;
+
+    if (mCongestionControl) mCongestionControl->reset();
+    mBytesInFlight = 0;
+    mPacingCredit = 2 * Buffer::Size;
+    mPacingTime = currentTime;
+    mNextDeparture = 0;
+    mNextSendTime = 0;
+    bWindowFull = false;
+    mSendTick = mNetwork->mSendTick;
+    mSendBudget = mNetwork->mConnectionSendBudget;
+    mDeferredBytes = 0;
+    bDeferred = false;
+
+    bMtuDiscovery = false;
+    mMtu = Buffer::Size;
+    mMtuMax = Buffer::MaxSize;
+    mMtuProbe = 0;
+    mMtuProbeCount = 0;
+    mMtuProbeTime = currentTime;
+
+    mReliableID = 0;
+    mFirstUnackedID = 1;
+    mUnreliableID = 0;
+    mReceivedReliableID = 0;
+    mReceivedUnreliableID = 0;
+    mUserData = 0;
+    mSecret = 0;
+    mChallenge = 0;
+    mChallengeEndpoint = boost::asio::ip::udp::endpoint();
+    mChallengeTime = 0;
+
+    auto& types = mNetwork->mChannelTypes;
+    mChannels.resize(types.size());
+    for (std::size_t i = 0; i < types.size(); i++) mChannels[i].reset(types[i]);
+
+    mState->heartbeat = currentTime;
+    mState->sentTime = currentTime;
+    mState->pingSentTime = currentTime;
+    mState->id = InvalidConnectionId;
+    mState->remoteId = InvalidConnectionId;
+    mState->connected = false;
+    mState->pendingSend = false;
+    mState->closing = false;
+}
+
+void Connection::recycle()
+{
+    mEarlyReliable.reset();
+    mEarlyCount = 0;
+    for (auto& c : mChannels)
+    {
+        for (auto& b : c.early)
+        {
+            if (b) mNetwork->releaseBuffer(b);
+            b = nullptr;
+        }
+        c.writing = nullptr;
+        dropReassembly(c);
+    }
+
+    for (auto& p : mReliablePackets)
+    {
+        if (p.buffer) mNetwork->releaseBuffer(p.buffer);
+        p.buffer = nullptr;
+    }
+    for (auto b : mReliableBacklog) mNetwork->releaseBuffer(b);
+    mReliableBacklog.clear();
+    for (auto b : mUnreliablePackets) mNetwork->releaseBuffer(b);
+    mUnreliablePackets.clear();
+
+    mReceivedReliableBits = 0;
+    bPendingAck = false;
 }
 
 Buffer* Connection::send(bool reliable/* = false*/)
+{
+    return send(reliable ? DefaultReliableChannel : DefaultUnreliableChannel);
+}
+
+Buffer* Connection::send(ChannelId channel, Priority priority/* = DefaultPriority*/)
+{
+    // Do not create another packet
+    Buffer* b = mChannels.at(channel).writing;
+    if (!b || b->getType() != PT_DATA) b = newChannelPacket(channel, PT_DATA);
+
+    b->raisePriority(priority);
+    return b;
+}
+
+Buffer& Connection::beginMessage()
+{
+    mMessage.clear();
+    return mMessage;
+}
+
+void Connection::endMessage(bool reliable/* = false*/)
+{
+    endMessage(reliable ? DefaultReliableChannel : DefaultUnreliableChannel);
+}
+
+void Connection::endMessage(ChannelId channel, Priority priority/* = DefaultPriority*/)
+{
+    sendMessage(&mMessage.data()[PacketHeaderSize], mMessage.size() - PacketHeaderSize, channel, priority);
+}
+
+void Connection::sendMessage(const byte* data, std::size_t size, bool reliable/* = false*/)
+{
+    sendMessage(data, size, reliable ? DefaultReliableChannel : DefaultUnreliableChannel);
+}
+
+void Connection::sendMessage(const byte* data, std::size_t size, ChannelId channel, Priority priority/* = DefaultPriority*/)
+{
+    Buffer* b = mChannels.at(channel).writing;
+
+    if (size > getMaxMessageSize())
+    {
+        sendFragments(channel, data, size, priority);
+        return;
+    }
+
+    // Pack with the previous messages, or start a new datagram
+    if (!b || b->getType() != PT_MESSAGE || !b->appendMessage(data, size))
+    {
+        b = newChannelPacket(channel, PT_MESSAGE);
+        b->appendMessage(data, size);
+    }
+    b->raisePriority(priority);
+}
+
+void Connection::sendFragments(ChannelId channel, const byte* data, std::size_t size, Priority priority)
+{
+    if (size > MaxFragmentedMessageSize) throw std::runtime_error("UDPNETWORK message too large!");
+
+    // Reassembled in order
+    if (mChannels[channel].type != CT_RELIABLE_ORDERED) channel = DefaultReliableChannel;
+
+    uint32_t total = size;
+    std::size_t fragmentSize = mMtu - PacketHeaderSize - FragmentHeaderSize;
+    for (uint32_t offset = 0; offset < size; offset += fragmentSize)
+    {
+        std::size_t length = std::min(fragmentSize, size - offset);
+
+        Buffer* b = newChannelPacket(channel, PT_FRAGMENT);
+        b->raisePriority(priority);
+        byte* p = &b->data()[PacketHeaderSize];
+        memcpy(p, &total, sizeof(total));
+        memcpy(p + sizeof(total), &offset, sizeof(offset));
+        memcpy(p + FragmentHeaderSize, data + offset, length);
+        b->size(PacketHeaderSize + FragmentHeaderSize + length);
+    }
+}
+
+Buffer* Connection::newPacket(bool reliable, byte type, std::size_t capacity/* = Buffer::MaxSize*/)
 {
     Buffer* b = 0;
 
     if (reliable)
     {
-        if (!mReliablePackets.empty() &&
-            !mReliablePackets.back().wasSent)
-        {
-            // Do not create another packet
-            return &mReliablePackets.back().buffer;
-        }
+        b = mNetwork->newBuffer(capacity);
+        b->setType(type);
+        b->setReliable(true);
 
-        mReliablePackets.emplace_back();
-        b = &mReliablePackets.back().buffer;
-        b->setId(++mReliableID);
+        if (mReliableBacklog.empty() && getReliableCount() < ReliableWindow) pushReliable(b);
+        else mReliableBacklog.push_back(b); // Sent once the oldest packets are acked
     }
     else
     {
-        if (!mUnreliablePackets.empty())
-        {
-            // Do not create another packet
-            return &mReliablePackets.back().buffer;
-        }
-
-        mUnreliablePackets.emplace_back();
-        b = &mUnreliablePackets.back().buffer;
+        b = mNetwork->newBuffer(capacity);
+        mUnreliablePackets.push_back(b);
+        b->setType(type);
         b->setId(++mUnreliableID);
     }
 
-    b->setType(PT_DATA); // Default type
-    b->setReliable(reliable);
+    b->setLimit(mMtu);
+    mNetwork->addPendingSend(this);
+    return b;
+}
 
+Buffer* Connection::newChannelPacket(ChannelId channel, byte type)
+{
+    auto& c = mChannels[channel];
+    Buffer* b = newPacket(c.isReliable(), type);
+    b->setChannel(channel);
+    b->setSequence(++c.sequence);
+    c.writing = b;
     return b;
 }
 
-void Connection::send(unsigned long time, boost::asio::ip::udp::socket& socket)
+void Connection::pushReliable(Buffer* b)
+{
+    if (mReliablePackets.empty()) mReliablePackets.resize(ReliableWindow);
+
+    b->setId(++mReliableID);
+    auto& p = getReliablePacket(mReliableID);
+    p.buffer = b;
+    p.wasSent = false;
+    p.resendCount = 0;
+    p.time = 0;
+}
+
+void Connection::schedule(unsigned long time, Socket& socket, std::vector<ScheduledPacket>& packets)
 {
-    // Write ack
-    if (!mAcks.empty())
+    if (bMtuDiscovery && mState->connected && time >= mMtuProbeTime) sendMtuProbe(time);
+
+    // New tick, refill the budget
+    if (mSendTick != mNetwork->mSendTick)
     {
-        if (!mUnreliablePackets.empty()) 
-        {
-            for (auto id : mAcks) mUnreliablePackets.back().buffer.addAck(id);
-        }
-        else if (!mReliablePackets.empty())
-        {
-            for (auto id : mAcks) mReliablePackets.back().buffer.addAck(id);
-        }
-        else
+        mSendTick = mNetwork->mSendTick;
+        mSendBudget = mNetwork->mConnectionSendBudget;
+        mDeferredBytes = 0;
+    }
+
+    // Give an id to the packets waiting for room in the window
+    while (!mReliableBacklog.empty() && getReliableCount() < ReliableWindow)
+    {
+        pushReliable(mReliableBacklog.front());
+        mReliableBacklog.pop_front();
+    }
+
+    bWindowFull = false;
+    bDeferred = false;
+    bLost = false;
+    mNextSendTime = 0;
+
+    // Unreliable, the control packets are not scheduled
+    for (auto b : mUnreliablePackets)
+    {
+        if (b->getType() == PT_DATA || b->getType() == PT_MESSAGE) packets.push_back({this, b, b->getPriority()});
+        else sendUnreliable(b, time, socket);
+    }
+
+    // Reliable, the new ones up to the congestion window
+    unsigned bytesInFlight = mBytesInFlight;
+    for (PacketId id = mFirstUnackedID; id != PacketId(mReliableID + 1); ++id)
+    {
+        auto& p = getReliablePacket(id);
+        if (!p.buffer) continue; // Acked
+
+        // Resend packet on timeout.
+        bool resend = p.wasSent && time - p.time >= getResendDelay(p);
+        if (p.wasSent && !resend) continue;
+
+        if (!p.wasSent && mCongestionControl)
         {
-            send(false); // Create new unreliable packet if no packet are queued for sending.
-            std::cout<<"mUnreliablePackets.size()="<<mUnreliablePackets.size()<<std::endl;
-            for (auto id : mAcks) mUnreliablePackets.back().buffer.addAck(id);
+            if (bytesInFlight && bytesInFlight + p.buffer->size() > mCongestionControl->getWindow())
+            {
+                // Only an ack sends the rest, none comes if nothing is in flight yet
+                bWindowFull = mBytesInFlight != 0;
+                break;
+            }
+            bytesInFlight += p.buffer->size();
         }
 
-        mAcks.clear();
+        packets.push_back({this, p.buffer, p.buffer->getPriority()});
     }
+}
 
-    if (!mReliablePackets.empty() || !mUnreliablePackets.empty()) mSentTime = time;
+bool Connection::sendScheduled(Buffer* b, unsigned long time, Socket& socket)
+{
+    if (!b->getReliable())
+    {
+        sendUnreliable(b, time, socket);
+        return true;
+    }
 
-    //
-    // Send
-    //
+    PacketId id = b->getId();
+    auto& p = getReliablePacket(id);
+    bool resend = p.wasSent;
 
-    boost::system::error_code errorCode;
-    
-    // Unreliable
+    unsigned delay = 0;
+    if (mCongestionControl)
     {
-        for (auto& p : mUnreliablePackets)
+        if (!p.wasSent && mBytesInFlight &&
+            mBytesInFlight + p.buffer->size() > mCongestionControl->getWindow())
+        {
+            bWindowFull = true;
+            return false;
+        }
+        if (resend && !bLost)
         {
-            std::cout<<"Sending unreliable packet"<<std::endl;
-            p.buffer.finalize();
-            socket.send_to(
-                boost::asio::buffer(p.buffer.data(), p.buffer.size()),
-                mEndpoint, 0, errorCode);
+            mCongestionControl->onLoss(mBytesInFlight, time);
+            bLost = true;
         }
+        if (!pace(p.buffer->size(), time, socket.hasTxTime(), delay)) return false;
     }
 
-    // Reliable
+    if (resend)
     {
-        for (auto& p : mReliablePackets)
+        UDP_NETWORK_TRACE(TE_PACKET_RESENT, this, id, p.buffer->size());
+        if (p.resendCount < 255) ++p.resendCount;
+
+        // Black hole, the path MTU may have dropped: back to the base size and search again
+        if (p.resendCount == MtuProbeCount && p.buffer->size() > Buffer::Size && mMtu > Buffer::Size)
         {
-            // Send reliable packet.
-            // Resend packet on timeout.
-            if (!p.wasSent || time - p.time >= mPing)
-            {
-                std::cout<<"Sending reliable packet"<<std::endl;
-                p.buffer.finalize();
-                socket.send_to(
-                    boost::asio::buffer(p.buffer.data(), p.buffer.size()),
-                    mEndpoint, 0, errorCode);
-
-                p.time = time;
-                p.wasSent = true;
-            }
+            mMtu = Buffer::Size;
+            mMtuMax = Buffer::MaxSize;
+            mMtuProbe = 0;
+            mMtuProbeTime = time;
+            UDP_NETWORK_TRACE(TE_MTU_CHANGED, this, mMtu, 0);
         }
     }
+    else
+    {
+        UDP_NETWORK_TRACE(TE_PACKET_SENT, this, id, p.buffer->size());
+        mBytesInFlight += p.buffer->size();
+    }
 
-    clear();
+    writeHeader(*p.buffer); // Latest acks, and the remote id may be known since the first send
+    socket.send(*p.buffer, mEndpoint, delay);
+
+    p.time = time;
+    p.wasSent = true;
+    mState->sentTime = time;
+    bPendingAck = false;
+    mSendBudget -= std::min<unsigned>(mSendBudget, p.buffer->size());
+    return true;
+}
+
+void Connection::sendUnreliable(Buffer* b, unsigned long time, Socket& socket)
+{
+    writeHeader(*b);
+    socket.send(*b, mEndpoint);
+    UDP_NETWORK_TRACE(TE_PACKET_SENT, this, b->getId(), b->size());
+
+    mSentPackets.push_back(b);
+    mState->sentTime = time;
+    bPendingAck = false;
+    if (b->getType() == PT_DATA || b->getType() == PT_MESSAGE) mSendBudget -= std::min<unsigned>(mSendBudget, b->size());
+}
+
+void Connection::defer(Buffer* b)
+{
+    UDP_NETWORK_TRACE(TE_PACKET_DEFERRED, this, b->getId(), b->size());
+
+    b->accumulatePriority();
+    if (!b->getReliable()) mDeferredPackets.push_back(b);
+    mDeferredBytes += b->size();
+    bDeferred = true;
+}
+
+void Connection::endSend(unsigned long time, Socket& socket)
+{
+    // Every scheduled unreliable packet was either sent or deferred
+    mUnreliablePackets.swap(mDeferredPackets);
+    mDeferredPackets.clear();
+
+    // Every packet carries the ack header, send one if nothing else went
+    if (bPendingAck)
+    {
+        Buffer* b = mNetwork->newBuffer(Buffer::SmallSize);
+        b->setType(PT_ACK);
+        b->setId(++mUnreliableID);
+        sendUnreliable(b, time, socket);
+    }
+
+    for (auto& c : mChannels) c.writing = nullptr;
+
+    // NOTE: the sent unreliable packets are released by the network once the socket is flushed
 }
 
 void Connection::addIncomingBuffer(Buffer* b, unsigned currentTime)
 {
-    mHeartbeat = currentTime;
+    mState->heartbeat = currentTime;
+
+    ChannelId channel = b->getChannel();
+    if (channel >= mChannels.size() || mChannels[channel].isReliable() != b->getReliable())
+    {
+        // The channels are not configured the same on both sides
+        mNetwork->releaseBuffer(b);
+        return;
+    }
 
     if (b->getReliable())
     {
-        while (b)
+        PacketId id = b->getId();
+        int16_t distance = id - mReceivedReliableID; // Wraps around
+
+        if (distance <= 0 || mEarlyReliable[id & (ReliableWindow - 1)])
         {
-            PacketId id = b->getId();
-            std::cout<<"Received Packet id: "<<(short)id<<std::endl;
+            // This packet is late (duplicated), our ack was probably lost
+            UDP_NETWORK_TRACE(TE_PACKET_DUPLICATED, this, id, 0);
+            setPendingAck();
+            mNetwork->releaseBuffer(b);
+            return;
+        }
 
-            if (id <= mReceivedReliableID)
+        if (distance >= ReliableWindow || !canHold(*b))
+        {
+            // Out of the window (misbehaving peer), or too many held: not acked, resent later
+            mNetwork->releaseBuffer(b);
+            return;
+        }
+
+        setPendingAck();
+
+        if (distance > 1)
+        {
+            // This packet is early, only its channel may have to wait for the missing ones
+            if (distance - 2 < 32) mReceivedReliableBits |= AckBits(1) << (distance - 2);
+            mEarlyReliable.set(id & (ReliableWindow - 1));
+            UDP_NETWORK_TRACE(TE_PACKET_EARLY, this, id, mEarlyCount);
+            UDP_NETWORK_LOG_DEBUG("Early packet received: id:" << id << " num held:" << mEarlyCount);
+        }
+        else
+        {
+            ++mReceivedReliableID;
+            mReceivedReliableBits >>= 1;
+
+            while (mEarlyReliable[PacketId(mReceivedReliableID + 1) & (ReliableWindow - 1)])
             {
-                // This packet is late (duplicated)
-                return;
+                mEarlyReliable.reset(++mReceivedReliableID & (ReliableWindow - 1));
+                mReceivedReliableBits >>= 1;
             }
-            if (id > mReceivedReliableID + 1)
+        }
+    }
+
+    receive(b, currentTime);
+}
+
+void Connection::receive(Buffer* b, unsigned currentTime)
+{
+    auto& c = mChannels[b->getChannel()];
+    PacketId sequence = b->getSequence();
+    int16_t distance = sequence - c.receivedSequence; // Wraps around
+
+    switch (c.type)
+    {
+        case CT_RELIABLE_ORDERED:
+            if (distance != 1)
             {
-                // This packet is early
-                mUnorderedBufferCache.insert({id, b});
-                std::cout<<"Early packet received: num cached:"<<mUnorderedBufferCache.size()<<std::endl;
+                // Wait for the previous packets of the channel, 'canHold' checked the room
+                if (c.early.empty()) c.early.resize(ReliableWindow, nullptr);
+                Buffer*& slot = c.early[sequence & (ReliableWindow - 1)];
+
+                if (distance <= 0 || slot) mNetwork->releaseBuffer(b);
+                else
+                {
+                    slot = b;
+                    ++mEarlyCount;
+                }
                 return;
             }
 
-            mAcks.push_back(id);
-            ++mReceivedReliableID;
-            mReceivedBuffers.push_back(b);
-            std::cout<<"Received reliable packet: id:"<<(unsigned)id<<std::endl;
-            
-            auto ubcit = mUnorderedBufferCache.find(mReceivedReliableID);
-            if (ubcit != mUnorderedBufferCache.end())
+            while (b)
             {
-                b = ubcit->second;
-                mUnorderedBufferCache.erase(ubcit);
+                ++c.receivedSequence;
+                deliver(c, b, currentTime);
+
+                if (!mEarlyCount || c.early.empty()) break;
+                Buffer*& slot = c.early[PacketId(c.receivedSequence + 1) & (ReliableWindow - 1)];
+                b = slot;
+                slot = nullptr;
+                if (b) --mEarlyCount;
             }
-            else
+            break;
+
+        case CT_UNRELIABLE_SEQUENCED:
+            if (distance <= 0)
             {
-                b = nullptr;
+                mNetwork->releaseBuffer(b); // Older than the last one delivered
+                return;
             }
+            c.receivedSequence = sequence;
+            deliver(c, b, currentTime);
+            break;
+
+        default:
+            deliver(c, b, currentTime);
+            break;
+    }
+}
+
+bool Connection::canHold(Buffer& b)
+{
+    auto& c = mChannels[b.getChannel()];
+    if (c.type != CT_RELIABLE_ORDERED) return true;
+
+    int16_t distance = b.getSequence() - c.receivedSequence; // Wraps around
+    return distance <= 1 || (distance < ReliableWindow && mEarlyCount < MaxEarlyPackets);
+}
+
+void Connection::deliver(Channel& c, Buffer* b, unsigned currentTime)
+{
+    UDP_NETWORK_TRACE(TE_PACKET_DELIVERED, this, b->getId(), b->getChannel());
+
+    if (b->getType() == PT_FRAGMENT) reassemble(c, b, currentTime);
+    else mReceivedBuffers.push_back(b);
+}
+
+// The fragments are delivered in order, only one message is reassembled at a time per channel
+void Connection::reassemble(Channel& c, Buffer* b, unsigned currentTime)
+{
+    if (c.reassembly && currentTime - c.reassemblyTime > ReassemblyTimeout) dropReassembly(c);
+
+    uint32_t size = 0;
+    uint32_t offset = 0;
+    std::size_t length = 0;
+    if (b->size() >= PacketHeaderSize + FragmentHeaderSize && c.type == CT_RELIABLE_ORDERED)
+    {
+        memcpy(&size, &b->data()[PacketHeaderSize], sizeof(size));
+        memcpy(&offset, &b->data()[PacketHeaderSize + sizeof(size)], sizeof(offset));
+        length = b->size() - PacketHeaderSize - FragmentHeaderSize;
+    }
+
+    if (!offset && length && size <= MaxFragmentedMessageSize)
+    {
+        dropReassembly(c); // Never completed
+        if (mReassemblySize + size > MaxReassemblySize)
+        {
+            // Too many partial messages on the other channels, this one is lost
+            mNetwork->releaseBuffer(b);
+            return;
         }
+
+        // Read like a raw data packet once complete
+        c.reassembly = mNetwork->newBuffer(PacketHeaderSize + size);
+        c.reassembly->setType(PT_DATA);
+        c.reassembly->setReliable(true);
+        c.reassembly->setChannel(b->getChannel());
+        c.reassemblySize = size;
+        mReassemblySize += size;
     }
-    else
+
+    if (!c.reassembly || size != c.reassemblySize || offset != c.reassembly->size() - PacketHeaderSize ||
+        offset + length > size)
+    {
+        // Timed out or invalid, wait for the next message
+        dropReassembly(c);
+        mNetwork->releaseBuffer(b);
+        return;
+    }
+
+    memcpy(&c.reassembly->data()[PacketHeaderSize + offset], &b->data()[PacketHeaderSize + FragmentHeaderSize], length);
+    c.reassembly->size(PacketHeaderSize + offset + length);
+    c.reassemblyTime = currentTime;
+    mNetwork->releaseBuffer(b);
+
+    if (offset + length == size)
+    {
+        mReceivedBuffers.push_back(c.reassembly);
+        c.reassembly = nullptr;
+        mReassemblySize -= size;
+    }
+}
+
+void Connection::dropReassembly(Channel& c)
+{
+    if (!c.reassembly) return;
+    mNetwork->releaseBuffer(c.reassembly);
+    c.reassembly = nullptr;
+    mReassemblySize -= c.reassemblySize;
+}
+
+void Connection::expireReassemblies(unsigned currentTime)
+{
+    if (!mReassemblySize) return;
+    for (auto& c : mChannels)
+    {
+        if (c.reassembly && currentTime - c.reassemblyTime > ReassemblyTimeout) dropReassembly(c);
+    }
+}
+
+unsigned long Connection::getNextReassemblyTimeout()
+{
+    unsigned long next = -1;
+    if (!mReassemblySize) return next;
+    for (auto& c : mChannels)
+    {
+        if (c.reassembly) next = std::min<unsigned long>(next, c.reassemblyTime + ReassemblyTimeout + 1);
+    }
+    return next;
+}
+
+void Connection::writeHeader(Buffer& b)
+{
+    b.setConnectionId(mState->remoteId);
+    b.setAck(mReceivedReliableID, mReceivedReliableBits);
+}
+
+void Connection::sendMtuProbe(unsigned long time)
+{
+    if (mMtuProbe && mMtuProbeCount >= MtuProbeCount)
     {
-        mReceivedBuffers.push_back(b);
+        mMtuMax = mMtuProbe - 1; // Too large
+        mMtuProbe = 0;
     }
+
+    if (!mMtuProbe)
+    {
+        if (mMtuMax < mMtu + MtuSearchGranularity)
+        {
+            mMtuMax = Buffer::MaxSize;
+            mMtuProbeTime = time + MtuSearchInterval;
+            return;
+        }
+
+        // The largest size first, the usual path, then a binary search
+        mMtuProbe = mMtuMax == Buffer::MaxSize ? mMtuMax : (mMtu + mMtuMax + 1) / 2;
+        mMtuProbeCount = 0;
+    }
+
+    // Padded to the probed size, the receiver replies with the size received
+    Buffer* b = newPacket(false, PT_MTU_PROBE);
+    b->setLimit(mMtuProbe);
+    *b << byte(0);
+    memset(&b->data()[b->size()], 0, mMtuProbe - b->size());
+    b->size(mMtuProbe);
+
+    ++mMtuProbeCount;
+    mMtuProbeTime = time + mRto;
 }
 
-void Connection::ack(PacketId id)
+void Connection::handleMtuProbe(Buffer& b, unsigned currentTime)
 {
-    std::cout<<__PRETTY_FUNCTION__<<" id:"<<(unsigned)id<<std::endl;
+    if (b.size() < PacketHeaderSize + 1) return;
+
+    if (!b.readByte())
+    {
+        auto reply = newPacket(false, PT_MTU_PROBE, Buffer::SmallSize);
+        *reply << byte(1) << uint32_t(b.size());
+        return;
+    }
 
-    auto it = std::find_if(
-        mReliablePackets.begin(),
-        mReliablePackets.end(),
-        [&](const ReliablePacket& p) { return p.buffer.getId() == id; });
+    if (b.size() < PacketHeaderSize + 1 + sizeof(uint32_t)) return;
+    uint32_t size;
+    b >> size;
 
-    if (it != mReliablePackets.end())
+    if (mMtuProbe && size == mMtuProbe)
     {
-        std::cout<<"Reliable packet acked: "<<(int)id<<std::endl;
-        mReliablePackets.erase(it);
+        mMtu = size;
+        mMtuProbe = 0;
+        mMtuProbeTime = currentTime; // Next size
+        mNetwork->addPendingSend(this);
+        UDP_NETWORK_TRACE(TE_MTU_CHANGED, this, size, 0);
     }
 }
 
+unsigned long Connection::getNextMtuProbeTime()
+{
+    if (!bMtuDiscovery || !mState->connected) return -1;
+    return mMtuProbeTime;
+}
+
+void Connection::setPendingAck()
+{
+    bPendingAck = true;
+    mNetwork->addPendingSend(this);
+}
+
+void Connection::ack(PacketId ack, AckBits bits, unsigned currentTime)
+{
+    // Every id up to 'ack' was received, ignore the old acks
+    PacketId count = ack + 1 - mFirstUnackedID;
+    if (count <= getReliableCount())
+    {
+        for (PacketId id = mFirstUnackedID; id != PacketId(ack + 1); ++id) release(id, currentTime);
+    }
+
+    // Received after a missing one
+    for (; bits; bits &= bits - 1)
+    {
+        release(ack + 2 + __builtin_ctz(bits), currentTime);
+    }
+
+    // Slide the window
+    PacketId first = mFirstUnackedID;
+    while (getReliableCount() && !getReliablePacket(mFirstUnackedID).buffer) ++mFirstUnackedID;
+
+    // Partial ack, the resent ones left were lost again or dropped by the peer holding
+    // 'MaxEarlyPackets' (never acked past the ack bits): resend them without their backoff
+    if (first != mFirstUnackedID && getReliableCount() && getReliablePacket(mFirstUnackedID).resendCount)
+    {
+        for (PacketId id = mFirstUnackedID; id != PacketId(mReliableID + 1); ++id)
+        {
+            auto& p = getReliablePacket(id);
+            if (p.buffer && p.resendCount) p.time = currentTime - getResendDelay(p);
+        }
+        mNetwork->addPendingSend(this);
+    }
+
+    if (bWindowFull)
+    {
+        bWindowFull = false;
+        mNetwork->addPendingSend(this);
+    }
+}
+
+void Connection::release(PacketId id, unsigned currentTime)
+{
+    if (PacketId(id - mFirstUnackedID) >= getReliableCount()) return; // Not in flight
+
+    auto& p = getReliablePacket(id);
+    if (!p.buffer) return; // Already acked
+    if (!p.wasSent) return; // Held back by the pacing or the window, not counted in flight yet
+
+    // Karn's algorithm, the ack of a resent packet may be for any of the copies
+    int rtt = p.resendCount ? -1 : int(currentTime - p.time);
+    if (rtt >= 0) addRttSample(rtt);
+
+    mBytesInFlight -= p.buffer->size();
+    if (mCongestionControl) mCongestionControl->onAck(p.buffer->size(), rtt, mBytesInFlight, currentTime);
+
+    mNetwork->releaseBuffer(p.buffer);
+    p.buffer = nullptr;
+    UDP_NETWORK_TRACE(TE_ACK_RECEIVED, this, id, 0);
+
+    if (mNetwork->mAckCb) mNetwork->mAckCb(this, id);
+}
+
 void Connection::sendPing(unsigned currentTime)
 {
-    mPingSentTime = currentTime;
-    send()->setType(PT_PING);
-    std::cout<<__PRETTY_FUNCTION__<<std::endl;
+    mState->pingSentTime = currentTime;
+    bWaitingPong = true;
+    newPacket(false, PT_PING, Buffer::SmallSize);
+    UDP_NETWORK_TRACE(TE_PING, this, 0, 0);
 }
 
 void Connection::handlePing()
 {
-    send()->setType(PT_PONG);
-    std::cout<<__PRETTY_FUNCTION__<<std::endl;
+    newPacket(false, PT_PONG, Buffer::SmallSize);
 }
 
 void Connection::handlePong(unsigned currentTime)
 {
-    mHeartbeat = currentTime;
-    std::cout<<__PRETTY_FUNCTION__<<std::endl;
+    mState->heartbeat = currentTime;
+    UDP_NETWORK_TRACE(TE_PONG, this, 0, 0);
+
+    if (bWaitingPong) addRttSample(currentTime - mState->pingSentTime);
+    bWaitingPong = false;
+}
+
+void Connection::addRttSample(unsigned rtt)
+{
+    if (!bRttMeasured)
+    {
+        mSrtt = rtt;
+        mRttVar = rtt / 2.f;
+        bRttMeasured = true;
+    }
+    else
+    {
+        mRttVar = 0.75f * mRttVar + 0.25f * std::abs(mSrtt - rtt);
+        mSrtt = 0.875f * mSrtt + 0.125f * rtt;
+    }
+
+    // Clock granularity is 1 ms
+    mRto = mSrtt + std::max(1.f, 4 * mRttVar) + 0.5f;
+    mRto = std::min(std::max(mRto, MinRto), MaxRto);
+}
+
+unsigned Connection::getResendDelay(const ReliablePacket& p)
+{
+    // Exponential backoff
+    unsigned delay = mRto;
+    for (byte i = 0; i < p.resendCount && delay < MaxRto; i++) delay *= 2;
+    return std::min(delay, MaxRto);
+}
+
+// Return false if the pacing rate does not allow to send 'size' bytes now
+bool Connection::pace(unsigned size, unsigned long time, bool txTime, unsigned& delay)
+{
+    delay = 0;
+    unsigned rate = mCongestionControl->getPacingRate();
+    if (!rate) return true;
+
+    if (txTime)
+    {
+        // Spread by the kernel, only held here past the horizon
+        uint64_t now = uint64_t(time) * 1000;
+        if (mNextDeparture < now) mNextDeparture = now;
+
+        uint64_t wait = mNextDeparture - now;
+        if (wait > PacingHorizon * 1000)
+        {
+            mNextSendTime = time + wait / 1000 - PacingHorizon;
+            return false;
+        }
+
+        delay = wait;
+        mNextDeparture += uint64_t(size) * 1000000 / rate;
+        return true;
+    }
+
+    // Token bucket refilled at the pacing rate
+    float burst = std::max(2.f * Buffer::Size, float(rate) * PacingHorizon / 1000);
+    mPacingCredit = std::min(mPacingCredit + float(rate) * (time - mPacingTime) / 1000, burst);
+    mPacingTime = time;
+
+    if (mPacingCredit <= 0)
+    {
+        mNextSendTime = time + std::max<unsigned long>(1, std::ceil(-mPacingCredit * 1000 / rate));
+        return false;
+    }
+
+    mPacingCredit -= size;
+    return true;
+}
+
+void Connection::setCongestionControl(CongestionControl* control)
+{
+    delete mCongestionControl;
+    mCongestionControl = control;
 }
 
 void Connection::clear()
 {
     for (auto b : mReceivedBuffers) mNetwork->releaseBuffer(b);
     mReceivedBuffers.clear();
-    mUnreliablePackets.clear();
-    std::cout<<__PRETTY_FUNCTION__<<std::endl;
+    for (auto b : mSentPackets) mNetwork->releaseBuffer(b);
+    mSentPackets.clear();
 }
 
 
+unsigned long Connection::getNextResendTime()
+{
+    if (bDeferred) return 0; // Next tick
+
+    unsigned long next = -1;
+    bool unsent = false;
+    for (PacketId id = mFirstUnackedID; id != PacketId(mReliableID + 1); ++id)
+    {
+        auto& p = getReliablePacket(id);
+        if (!p.buffer) continue;
+        if (!p.wasSent)
+        {
+            if (!bWindowFull) return mNextSendTime;
+            unsent = true; // Sent on ack, the sent ones may be further in the window
+            continue;
+        }
+        next = std::min<unsigned long>(next, p.time + getResendDelay(p));
+    }
+    if (unsent && next == (unsigned long)-1) return mNextSendTime; // Never wait without a timer
+    return std::max(next, mNextSendTime);
+}
+
 void Connection::disconnect()
 {
     mNetwork->disconnect(this);
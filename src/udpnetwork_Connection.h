@@ -1,74 +1,220 @@
 #pragma once
 
+#include "udpnetwork_Channel.h"
+#include "udpnetwork_CongestionControl.h"
+#include "udpnetwork_ConnectionPool.h"
 #include "udpnetwork_Packet.h"
 
 #include <boost/asio/ip/udp.hpp>
-#include <unordered_map>
-#include <list>
+#include <bitset>
+#include <deque>
 
 namespace udp_network
 {
 
 class Network;
+class Socket;
+struct ScheduledPacket;
 
 class Connection 
 {
 friend class Network;
+friend class ConnectionPool;
 
 public:
-    Connection(Network* network, const boost::asio::ip::udp::endpoint& endpoint, unsigned currentTime);
+    static const PacketId ReliableWindow = 1024; // Reliable packets in flight, power of 2
+
+    // Received packets held for the missing ones of their ordered channel. Past
+    // that the early packets are dropped without being acked, and resent later.
+    static const unsigned MaxEarlyPackets = 256;
+
+    // Retransmission timeout (RFC 6298), doubled on each resend of a packet.
+    // The RFC minimum of 1 second is far too long for real time traffic.
+    static const unsigned InitialRto = 1000;
+    static const unsigned MinRto = 50;
+    static const unsigned MaxRto = 8000;
+
+    // Milliseconds of sends released at once when paced
+    static const unsigned PacingHorizon = 10;
+
+    // Larger messages are sent in reliable fragments, reassembled one at a time
+    // per channel. A partial message is dropped when no fragment came for
+    // 'ReassemblyTimeout', or refused past 'MaxReassemblySize' for all the
+    // channels of the connection.
+    static const std::size_t MaxFragmentedMessageSize = 256 * 1024;
+    static const std::size_t MaxReassemblySize = 1024 * 1024;
+    static const unsigned ReassemblyTimeout = 10000;
+
+    // Path MTU discovery, after DPLPMTUD (RFC 8899): padded probes search the
+    // largest datagram between 'Buffer::Size' and 'Buffer::MaxSize'.
+    static const unsigned MtuProbeCount = 3;          // Lost probes before a size is given up
+    static const unsigned MtuSearchGranularity = 16;  // Bytes
+    static const unsigned MtuSearchInterval = 600000; // Search again, the path may have changed
+
+    // Connections are created by the network connection pool
+    Connection(Network* network, ConnectionState* state);
     ~Connection();
 
+    // Raw packet, the writes of a tick go in the same packet until it is full.
+    // 'reliable' picks the default reliable or unreliable channel.
+    // 'priority' is a weight, at least 1: when the send budgets of the network
+    // are reached the packets are sent by priority, a packet takes the highest
+    // priority of the messages written in it.
     Buffer* send(bool reliable = false);
+    Buffer* send(ChannelId channel, Priority priority = DefaultPriority);
+
+    // Length prefixed messages, packed with the other messages of the tick in
+    // as few datagrams as possible. Read them with 'Buffer::nextMessage'.
+    // 'beginMessage' returns the buffer to write the message in, queued by 'endMessage'.
+    // Messages larger than 'getMaxMessageSize' are fragmented, and always reliable
+    // ordered: on the default reliable channel unless their channel is reliable ordered.
+    Buffer& beginMessage();
+    void endMessage(bool reliable = false);
+    void endMessage(ChannelId channel, Priority priority = DefaultPriority);
+    void sendMessage(const byte* data, std::size_t size, bool reliable = false);
+    void sendMessage(const byte* data, std::size_t size, ChannelId channel, Priority priority = DefaultPriority);
+    std::size_t getMaxMessageSize() { return mMtu - PacketHeaderSize - sizeof(MessageSize); } // Not fragmented
+
+    unsigned getMtu() { return mMtu; } // Largest datagram sent
+
     std::vector<Buffer*>& getIncomingBuffers() { return mReceivedBuffers; }
     const boost::asio::ip::udp::endpoint& getEndpoint() { return mEndpoint; }
-
-    unsigned getPing() { return mPing; }
-    unsigned getHeartbeat() { return mHeartbeat; }
-    unsigned getSentTime() { return mSentTime; }
-    unsigned getPingSentTime() { return mPingSentTime; }
+    Network* getNetwork() { return mNetwork; }
+    ConnectionId getId() { return mState->id; }
+    ConnectionId getRemoteId() { return mState->remoteId; }
+
+    // Smoothed round trip time, from the acks and the pongs
+    unsigned getPing() { return mSrtt + 0.5f; }
+    unsigned getRttVariance() { return mRttVar + 0.5f; }
+    unsigned getRto() { return mRto; }
+    unsigned getHeartbeat() { return mState->heartbeat; }
+    unsigned getSentTime() { return mState->sentTime; }
+    unsigned getPingSentTime() { return mState->pingSentTime; }
+
+    // Take the ownership of 'control', nullptr to send without limit.
+    // Set by the network when created, reset when a pooled connection is reused.
+    void setCongestionControl(CongestionControl* control);
+    CongestionControl* getCongestionControl() { return mCongestionControl; }
+    unsigned getBytesInFlight() { return mBytesInFlight; }
+    std::size_t getReassemblySize() { return mReassemblySize; } // Partial fragmented messages
+
+    // Held back by the send budgets during the current tick
+    unsigned getDeferredBytes() { return mDeferredBytes; }
     
     void* getUserData() { return mUserData; }
     void setUserData(void* data) { mUserData = data; }
 
-    bool isConnected() { return mIsConnected; }
+    bool isConnected() { return mState->connected; }
     void disconnect();
 
     std::string printInfo();
 
 protected:
     void addIncomingBuffer(Buffer* buff, unsigned currentTime);
-    void send(unsigned long time, boost::asio::ip::udp::socket& socket);
+    void receive(Buffer* buff, unsigned currentTime); // In its channel
+    bool canHold(Buffer& buff); // Room to wait in its channel
+    void deliver(Channel& channel, Buffer* buff, unsigned currentTime);
+    void reassemble(Channel& channel, Buffer* fragment, unsigned currentTime);
+    void dropReassembly(Channel& channel);
+    void expireReassemblies(unsigned currentTime); // From the timer
+    unsigned long getNextReassemblyTimeout();
+
+    // Send, through the network scheduler: the control packets are sent right
+    // away, the data packets due are added to 'packets' and sent or deferred.
+    void schedule(unsigned long time, Socket& socket, std::vector<ScheduledPacket>& packets);
+    bool sendScheduled(Buffer*, unsigned long time, Socket& socket); // False if held back by the congestion control
+    void sendUnreliable(Buffer*, unsigned long time, Socket& socket);
+    void defer(Buffer*); // Over the budgets
+    void endSend(unsigned long time, Socket& socket);
     
     void sendPing(unsigned currentTime);
     void handlePing();
     void handlePong(unsigned currentTime);
 
-    void ack(unsigned short id);
-    void setConnected(bool state = true) { mIsConnected = state; }
+    void ack(PacketId ack, AckBits bits, unsigned currentTime);
+    void release(PacketId id, unsigned currentTime); // Acked
+    void addRttSample(unsigned rtt);
+    unsigned getResendDelay(const ReliablePacket& p);
+    bool pace(unsigned size, unsigned long time, bool txTime, unsigned& delay);
+    void writeHeader(Buffer&);
+    void setPendingAck();
+    void sendMtuProbe(unsigned long time);
+    void handleMtuProbe(Buffer& probe, unsigned currentTime);
+    unsigned long getNextMtuProbeTime();
+    void setConnected(bool state = true) { mState->connected = state; }
     void clear();
 
+    void reset(const boost::asio::ip::udp::endpoint& endpoint, unsigned currentTime);
+    void recycle(); // Release everything, keep the containers capacity
+
+    unsigned long getNextResendTime();
+
+    PacketId getReliableCount() { return mReliableID + 1 - mFirstUnackedID; } // In the window
+    ReliablePacket& getReliablePacket(PacketId id) { return mReliablePackets[id & (ReliableWindow - 1)]; }
+    void pushReliable(Buffer*);
+    Buffer* newPacket(bool reliable, byte type, std::size_t capacity = Buffer::MaxSize);
+    Buffer* newChannelPacket(ChannelId channel, byte type);
+    void sendFragments(ChannelId channel, const byte* data, std::size_t size, Priority priority);
+
 private:
+    ConnectionState* mState; // Owned by the pool
     Network* mNetwork;
     boost::asio::ip::udp::endpoint mEndpoint;
 
-    std::vector<Buffer*> mReceivedBuffers;
-    std::unordered_map<unsigned short, Buffer*> mUnorderedBufferCache;
-    std::vector<UnreliablePacket> mUnreliablePackets;
-    std::list<ReliablePacket> mReliablePackets;
-
-    std::vector<PacketId> mAcks;
+    // Migration, the peer must prove the handshake secret from its new address
+    uint64_t mSecret;                                   // Chosen by the accepting network
+    uint64_t mChallenge;                                // Nonce sent to 'mChallengeEndpoint', 0 if none
+    boost::asio::ip::udp::endpoint mChallengeEndpoint;
+    unsigned long mChallengeTime;
 
-    unsigned mPing;
-    unsigned short mReliableID;
+    std::vector<Buffer*> mReceivedBuffers;
+    std::bitset<ReliableWindow> mEarlyReliable;   // Received after a missing one, indexed by id % ReliableWindow
+    unsigned mEarlyCount;                         // Held in the channels
+    std::size_t mReassemblySize;                  // Allocated by the channels reassembling
+    std::vector<Channel> mChannels;
+    std::vector<Buffer*> mUnreliablePackets;     // Queued, or deferred
+    std::vector<Buffer*> mSentPackets;           // Unreliable, released once the socket is flushed
+    std::vector<Buffer*> mDeferredPackets;       // Unreliable, during the send
+    std::vector<ReliablePacket> mReliablePackets; // Sliding window, indexed by id % ReliableWindow
+    std::deque<Buffer*> mReliableBacklog;         // Window full, waiting for an id
+    Buffer mMessage;                              // 'beginMessage'
+
+    AckBits mReceivedReliableBits; // Received after 'mReceivedReliableID' + 1
+    bool bPendingAck;
+
+    float mSrtt;
+    float mRttVar;
+    unsigned mRto;
+    bool bRttMeasured;
+    bool bWaitingPong;
+
+    CongestionControl* mCongestionControl;
+    unsigned mBytesInFlight;        // Reliable bytes sent and not acked
+    float mPacingCredit;            // Bytes, token bucket
+    unsigned long mPacingTime;
+    uint64_t mNextDeparture;        // Microseconds, with SO_TXTIME
+    unsigned long mNextSendTime;    // Held back by the pacing until then
+    bool bWindowFull;               // Held back until acked
+    bool bLost;                     // Loss signaled during this send
+
+    unsigned mSendTick;             // Budget refilled on a new network tick
+    unsigned mSendBudget;           // Bytes left during the tick, if the network sets a connection budget
+    unsigned mDeferredBytes;
+    bool bDeferred;                 // Sent on the next tick
+
+    bool bMtuDiscovery;             // Set by the network
+    unsigned mMtu;                  // Confirmed
+    unsigned mMtuMax;               // Search upper bound
+    unsigned mMtuProbe;             // Size probed, 0 if none
+    unsigned mMtuProbeCount;
+    unsigned long mMtuProbeTime;    // Next probe
+
+    unsigned short mReliableID;     // Last id given
+    unsigned short mFirstUnackedID; // Window start
     unsigned short mUnreliableID;
     unsigned short mReceivedReliableID;
     unsigned short mReceivedUnreliableID;
 
-    unsigned mSentTime;
-    unsigned mPingSentTime;
-    unsigned mHeartbeat;
-    bool mIsConnected;
     void* mUserData;
 };
 
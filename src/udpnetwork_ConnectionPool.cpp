@@ -0,0 +1,42 @@
+#include "udpnetwork_ConnectionPool.h"
+#include "udpnetwork_Connection.h"
+
+using namespace udp_network;
+
+ConnectionPool::ConnectionPool(Network* network)
+:   mNetwork(network)
+{
+}
+
+Connection* ConnectionPool::acquire(const boost::asio::ip::udp::endpoint& endpoint, unsigned currentTime)
+{
+    Connection* c = nullptr;
+    if (mFree.empty())
+    {
+        mStates.emplace_back();
+        mConnections.emplace_back(mNetwork, &mStates.back());
+        c = &mConnections.back();
+    }
+    else
+    {
+        c = mFree.back();
+        mFree.pop_back();
+    }
+
+    c->reset(endpoint, currentTime);
+    return c;
+}
+
+void ConnectionPool::release(Connection* c)
+{
+    c->clear();
+    c->recycle();
+    mFree.push_back(c);
+}
+
+void ConnectionPool::clear()
+{
+    mFree.clear();
+    mConnections.clear();
+    mStates.clear();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "udpnetwork_Packet.h"
+#include "udpnetwork_TimerWheel.h"
+
+#include <boost/asio/ip/udp.hpp>
+#include <deque>
+#include <vector>
+
+namespace udp_network
+{
+
+class Connection;
+class Network;
+
+// State read on every timer expiration and scheduling, kept apart from the
+// packet queues so that the network update only touches contiguous memory.
+struct ConnectionState
+{
+    ConnectionState()
+    :   connection(nullptr), heartbeat(0), sentTime(0), pingSentTime(0),
+        id(InvalidConnectionId), remoteId(InvalidConnectionId),
+        connected(false), pendingSend(false), closing(false) {}
+
+    TimerNode timer;        // Next timeout, ping, connection request or resend (owner: this)
+    Connection* connection;
+    unsigned heartbeat;
+    unsigned sentTime;
+    unsigned pingSentTime;
+    ConnectionId id;        // Assigned by our network, written in the packets by the peer
+    ConnectionId remoteId;  // Assigned by the peer network, written in our packets
+    bool connected;
+    bool pendingSend;       // In the network send list
+    bool closing;           // Destruction queued
+};
+
+// Connections are never freed, released ones are reused with the capacity
+// of their containers. The states and the connections are stored in
+// deques, the pointers stay valid as the pool grows.
+class ConnectionPool
+{
+public:
+    ConnectionPool(Network* network);
+
+    Connection* acquire(const boost::asio::ip::udp::endpoint& endpoint, unsigned currentTime);
+    void release(Connection*);
+    void clear(); // Destroy every connection
+
+    std::size_t size() { return mConnections.size(); }
+    std::size_t getFreeCount() { return mFree.size(); }
+
+protected:
+    Network* mNetwork;
+    std::deque<ConnectionState> mStates;
+    std::deque<Connection> mConnections;
+    std::vector<Connection*> mFree;
+};
+
+} // udp_network
@@ -0,0 +1,422 @@
+#include "udpnetwork_IoUring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace udp_network;
+
+#ifdef __linux__
+
+namespace
+{
+
+const __u64 SendTag = ~(__u64)0;
+const __u64 ReceiveTag = SendTag - 1; // Multishot recvmsg, the single shot ones have their entry
+const __u16 BufferGroup = 0;
+
+int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+} // anonymous namespace
+
+IoUring::IoUring()
+:   mSocket(-1), mFd(-1), mEntries(0),
+    mSqRing(MAP_FAILED), mCqRing(MAP_FAILED),
+    mSqRingSize(0), mCqRingSize(0),
+    mSqes((io_uring_sqe*)MAP_FAILED), mSqesSize(0),
+    mSqeTail(0), mSendsInFlight(0),
+    mSlab((byte*)MAP_FAILED), mSlabSize(0), mEntrySize(0), mEntryCount(0),
+    mBufferRing(MAP_FAILED), mBufferRingSize(0), mBufferRingTail(0),
+    bMultishot(false), bReceiveArmed(false), bReceived(false)
+{
+    std::memset(&mReceiveMessage, 0, sizeof(mReceiveMessage));
+}
+
+IoUring::~IoUring()
+{
+    // Closing the ring cancels the receives, before their memory goes
+    if (mFd >= 0) close(mFd);
+
+    if (mBufferRing != MAP_FAILED) munmap(mBufferRing, mBufferRingSize);
+    if (mSlab != MAP_FAILED) munmap(mSlab, mSlabSize);
+    if (mSqes != MAP_FAILED) munmap(mSqes, mSqesSize);
+    if (mCqRing != MAP_FAILED && mCqRing != mSqRing) munmap(mCqRing, mCqRingSize);
+    if (mSqRing != MAP_FAILED) munmap(mSqRing, mSqRingSize);
+}
+
+bool IoUring::init(int socket, unsigned receiveDepth)
+{
+    mSocket = socket;
+
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+
+    mEntryCount = 1;
+    while (mEntryCount < std::min(receiveDepth, 32768u)) mEntryCount <<= 1;
+
+    // Room for the posted receives and a full batch of sends
+    unsigned entries = 1;
+    while (entries < mEntryCount * 2) entries <<= 1;
+
+    mFd = io_uring_setup(entries, &p);
+    if (mFd < 0) return false;
+    mEntries = p.sq_entries;
+
+    mSqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    mCqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) mSqRingSize = mCqRingSize = std::max(mSqRingSize, mCqRingSize);
+
+    mSqRing = mmap(0, mSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+    if (mSqRing == MAP_FAILED) return false;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) mCqRing = mSqRing;
+    else
+    {
+        mCqRing = mmap(0, mCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+        if (mCqRing == MAP_FAILED) return false;
+    }
+
+    mSqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    mSqes = (io_uring_sqe*)mmap(0, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+    if (mSqes == MAP_FAILED) return false;
+
+    byte* sq = (byte*)mSqRing;
+    mSqHead = (unsigned*)(sq + p.sq_off.head);
+    mSqTail = (unsigned*)(sq + p.sq_off.tail);
+    mSqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    mSqeTail = *mSqTail;
+
+    // Sqe index 'i' always goes in the slot 'i' of the submission array
+    unsigned* array = (unsigned*)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+
+    byte* cq = (byte*)mCqRing;
+    mCqHead = (unsigned*)(cq + p.cq_off.head);
+    mCqTail = (unsigned*)(cq + p.cq_off.tail);
+    mCqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    mCqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Receive entries: a datagram, after the multishot recvmsg header and address
+    mReceiveMessage.msg_namelen = boost::asio::ip::udp::endpoint().capacity();
+    std::size_t header = 0;
+#ifdef IORING_RECV_MULTISHOT
+    header = sizeof(io_uring_recvmsg_out) + mReceiveMessage.msg_namelen;
+#endif
+    mEntrySize = (Buffer::MaxSize + header + 63) & ~std::size_t(63);
+    mSlabSize = mEntrySize * mEntryCount;
+    mSlab = (byte*)mmap(0, mSlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mSlab == MAP_FAILED) return false;
+
+    bMultishot = initBufferRing();
+    if (bMultishot) armReceive();
+    else
+    {
+        mPostedReceives.resize(mEntryCount);
+        for (unsigned i = 0; i < mEntryCount; i++) postReceive(i);
+    }
+    submit();
+
+    return true;
+}
+
+bool IoUring::initBufferRing()
+{
+#ifdef IORING_RECV_MULTISHOT
+    mBufferRingSize = mEntryCount * sizeof(io_uring_buf);
+    mBufferRing = mmap(0, mBufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (mBufferRing == MAP_FAILED) return false;
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (__u64)(uintptr_t)mBufferRing;
+    reg.ring_entries = mEntryCount;
+    reg.bgid = BufferGroup;
+
+    // Before 5.19
+    if (io_uring_register(mFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        munmap(mBufferRing, mBufferRingSize);
+        mBufferRing = MAP_FAILED;
+        return false;
+    }
+
+    for (unsigned i = 0; i < mEntryCount; i++) recycleEntry(i);
+    return true;
+#else
+    return false;
+#endif
+}
+
+io_uring_sqe* IoUring::getSqe()
+{
+    unsigned head = __atomic_load_n(mSqHead, __ATOMIC_ACQUIRE);
+    if (mSqeTail - head >= mEntries) return nullptr;
+
+    io_uring_sqe* sqe = &mSqes[mSqeTail & *mSqMask];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ++mSqeTail;
+    return sqe;
+}
+
+void IoUring::submit(unsigned waitCount/* = 0*/)
+{
+    unsigned toSubmit = mSqeTail - *mSqTail;
+    __atomic_store_n(mSqTail, mSqeTail, __ATOMIC_RELEASE);
+
+    if (!toSubmit && !waitCount) return;
+
+    unsigned flags = waitCount ? IORING_ENTER_GETEVENTS : 0;
+    while (io_uring_enter(mFd, toSubmit, waitCount, flags) < 0 && errno == EINTR) {}
+}
+
+io_uring_cqe* IoUring::peekCqe()
+{
+    unsigned tail = __atomic_load_n(mCqTail, __ATOMIC_ACQUIRE);
+    if (*mCqHead == tail) return nullptr;
+    return &mCqes[*mCqHead & *mCqMask];
+}
+
+void IoUring::seenCqe()
+{
+    __atomic_store_n(mCqHead, *mCqHead + 1, __ATOMIC_RELEASE);
+}
+
+void IoUring::armReceive()
+{
+#ifdef IORING_RECV_MULTISHOT
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe)
+    {
+        submit();
+        sqe = getSqe();
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = mSocket;
+    sqe->addr = (__u64)(uintptr_t)&mReceiveMessage;
+    sqe->len = 1;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BufferGroup;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = ReceiveTag;
+    bReceiveArmed = true;
+#endif
+}
+
+void IoUring::postReceive(unsigned entry)
+{
+    PostedReceive& r = mPostedReceives[entry];
+
+    r.iov.iov_base = getEntry(entry);
+    r.iov.iov_len = mEntrySize;
+    std::memset(&r.message, 0, sizeof(r.message));
+    r.message.msg_name = r.endpoint.data();
+    r.message.msg_namelen = r.endpoint.capacity();
+    r.message.msg_iov = &r.iov;
+    r.message.msg_iovlen = 1;
+
+    io_uring_sqe* sqe = getSqe();
+    if (!sqe)
+    {
+        // Make room, the ring is sized for all the receives to be posted
+        submit();
+        sqe = getSqe();
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = mSocket;
+    sqe->addr = (__u64)(uintptr_t)&r.message;
+    sqe->len = 1;
+    sqe->user_data = entry;
+}
+
+void IoUring::recycleEntry(unsigned entry)
+{
+#ifdef IORING_RECV_MULTISHOT
+    // Not 'io_uring_buf_ring', its flexible array is shifted in C++. The tail
+    // is the 'resv' of the first entry
+    io_uring_buf* ring = (io_uring_buf*)mBufferRing;
+    io_uring_buf& b = ring[mBufferRingTail & (mEntryCount - 1)];
+    b.addr = (__u64)(uintptr_t)getEntry(entry);
+    b.len = mEntrySize;
+    b.bid = entry;
+    __atomic_store_n(&ring[0].resv, ++mBufferRingTail, __ATOMIC_RELEASE);
+#endif
+}
+
+bool IoUring::completeReceive(const io_uring_cqe& cqe, Buffer* buffer, boost::asio::ip::udp::endpoint& endpoint)
+{
+#ifdef IORING_RECV_MULTISHOT
+    if (cqe.user_data == ReceiveTag)
+    {
+        if (!(cqe.flags & IORING_CQE_F_MORE)) bReceiveArmed = false; // Out of entries, or an error
+
+        // Kernel without multishot recvmsg (before 6.0), post them one by one
+        if (cqe.res == -EINVAL && !bReceived)
+        {
+            bMultishot = false;
+            mPostedReceives.resize(mEntryCount);
+            for (unsigned i = 0; i < mEntryCount; i++) postReceive(i);
+            return false;
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) return false;
+        unsigned entry = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        const byte* data = getEntry(entry);
+
+        // Header, address, then the datagram
+        io_uring_recvmsg_out out;
+        std::size_t offset = sizeof(out) + mReceiveMessage.msg_namelen;
+        bool received = false;
+        if (cqe.res >= (int)sizeof(out))
+        {
+            bReceived = true;
+            std::memcpy(&out, data, sizeof(out));
+            if (!(out.flags & MSG_TRUNC) && out.namelen <= mReceiveMessage.msg_namelen &&
+                offset + out.payloadlen <= (unsigned)cqe.res && out.payloadlen <= buffer->capacity())
+            {
+                std::memcpy(endpoint.data(), data + sizeof(out), out.namelen);
+                endpoint.resize(out.namelen);
+                std::memcpy(buffer->data().data(), data + offset, out.payloadlen);
+                buffer->size(out.payloadlen);
+                received = true;
+            }
+        }
+
+        recycleEntry(entry);
+        return received;
+    }
+#endif
+
+    unsigned entry = (unsigned)cqe.user_data;
+    PostedReceive& r = mPostedReceives[entry];
+    bool received = cqe.res > 0 && (unsigned)cqe.res <= buffer->capacity();
+    if (received)
+    {
+        r.endpoint.resize(r.message.msg_namelen);
+        endpoint = r.endpoint;
+        std::memcpy(buffer->data().data(), getEntry(entry), cqe.res);
+        buffer->size(cqe.res);
+    }
+
+    postReceive(entry);
+    return received;
+}
+
+void IoUring::send(const OutgoingDatagram* datagrams, std::size_t count)
+{
+    std::size_t sent = 0;
+    while (sent < count)
+    {
+        // The messages must stay valid until the sends complete
+        std::size_t batch = std::min<std::size_t>(count - sent, mEntries / 2);
+        mSendMessages.resize(batch);
+        mSendIovecs.resize(batch);
+
+        std::size_t queued = 0;
+        for (; queued < batch; queued++)
+        {
+            io_uring_sqe* sqe = getSqe();
+            if (!sqe) break;
+
+            const OutgoingDatagram& d = datagrams[sent + queued];
+            mSendIovecs[queued].iov_base = const_cast<byte*>(d.data);
+            mSendIovecs[queued].iov_len = d.size;
+
+            msghdr& h = mSendMessages[queued];
+            std::memset(&h, 0, sizeof(h));
+            h.msg_name = const_cast<sockaddr*>(d.endpoint.data());
+            h.msg_namelen = d.endpoint.size();
+            h.msg_iov = &mSendIovecs[queued];
+            h.msg_iovlen = 1;
+
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = mSocket;
+            sqe->addr = (__u64)(uintptr_t)&h;
+            sqe->len = 1;
+            // Fail with EAGAIN on full socket buffer (dropped), instead of waiting
+            sqe->msg_flags = MSG_DONTWAIT;
+            sqe->user_data = SendTag;
+        }
+
+        // Submit everything and wait for the sends in the same call, on udp
+        // they complete inline.
+        mSendsInFlight += queued;
+        submit(mSendsInFlight);
+
+        while (mSendsInFlight)
+        {
+            io_uring_cqe* cqe = peekCqe();
+            if (!cqe)
+            {
+                submit(mSendsInFlight);
+                continue;
+            }
+
+            if (cqe->user_data == SendTag) --mSendsInFlight;
+            else mCompletedReceives.push_back(*cqe);
+            seenCqe();
+        }
+
+        sent += queued;
+    }
+}
+
+std::size_t IoUring::receive(Buffer** buffers, boost::asio::ip::udp::endpoint* endpoints, std::size_t count)
+{
+    std::size_t received = 0;
+
+    // Completed while sending
+    std::size_t completed = 0;
+    for (; received < count && completed < mCompletedReceives.size(); completed++)
+    {
+        if (completeReceive(mCompletedReceives[completed], buffers[received], endpoints[received])) ++received;
+    }
+    mCompletedReceives.erase(mCompletedReceives.begin(), mCompletedReceives.begin() + completed);
+
+    while (received < count)
+    {
+        io_uring_cqe* cqe = peekCqe();
+        if (!cqe) break;
+
+        // Seen first, completing may submit
+        io_uring_cqe c = *cqe;
+        seenCqe();
+        if (c.user_data == SendTag) continue;
+        if (completeReceive(c, buffers[received], endpoints[received])) ++received;
+    }
+
+    // Rearm, or submit the reposted receives
+    if (bMultishot && !bReceiveArmed) armReceive();
+    submit();
+    return received;
+}
+
+#else
+
+IoUring::IoUring() : mFd(-1) {}
+IoUring::~IoUring() {}
+bool IoUring::init(int, unsigned) { return false; }
+void IoUring::send(const OutgoingDatagram*, std::size_t) {}
+std::size_t IoUring::receive(Buffer**, boost::asio::ip::udp::endpoint*, std::size_t) { return 0; }
+
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "udpnetwork_Socket.h"
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#endif
+
+namespace udp_network
+{
+
+// io_uring backend of the Socket, talking to the kernel with the raw syscalls.
+//
+// The datagrams are received in a slab of fixed size entries, registered as a
+// provided buffer ring: a single multishot recvmsg stays armed and the kernel
+// picks an entry for each datagram. A received datagram is copied in the
+// caller's buffer and its entry given back to the ring right away. The kernels
+// without multishot recvmsg (before 6.0) get one recvmsg posted per entry.
+//
+// The sends of a flush are submitted with a single io_uring_enter(), which
+// also waits for them: they complete inline on udp, and the caller's buffers
+// must stay valid until then. Checking for received datagrams only reads the
+// completion ring.
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    // Return false if io_uring is not supported by the kernel
+    bool init(int socket, unsigned receiveDepth);
+
+    void send(const OutgoingDatagram* datagrams, std::size_t count);
+    std::size_t receive(Buffer** buffers, boost::asio::ip::udp::endpoint* endpoints, std::size_t count);
+
+    // Readable (poll) when completions are waiting
+    int getFd() { return mFd; }
+
+#ifdef __linux__
+protected:
+    // Receive without a provided buffer ring
+    struct PostedReceive
+    {
+        boost::asio::ip::udp::endpoint endpoint;
+        msghdr message;
+        iovec iov;
+    };
+
+    io_uring_sqe* getSqe();
+    void submit(unsigned waitCount = 0);
+    io_uring_cqe* peekCqe();
+    void seenCqe();
+
+    bool initBufferRing();
+    void armReceive();          // Multishot
+    void postReceive(unsigned entry); // Single shot
+    void recycleEntry(unsigned entry);
+
+    // Copy the datagram of a receive completion, return false if there is none
+    bool completeReceive(const io_uring_cqe& cqe, Buffer* buffer, boost::asio::ip::udp::endpoint& endpoint);
+
+    byte* getEntry(unsigned entry) { return mSlab + entry * mEntrySize; }
+
+    int mSocket;
+    int mFd;
+    unsigned mEntries;
+
+    void* mSqRing;
+    void* mCqRing;
+    std::size_t mSqRingSize;
+    std::size_t mCqRingSize;
+    io_uring_sqe* mSqes;
+    std::size_t mSqesSize;
+
+    unsigned* mSqHead;
+    unsigned* mSqTail;
+    unsigned* mSqMask;
+    unsigned* mCqHead;
+    unsigned* mCqTail;
+    unsigned* mCqMask;
+    io_uring_cqe* mCqes;
+
+    unsigned mSqeTail;      // Local tail, published on submit
+    unsigned mSendsInFlight;
+
+    // Receive entries
+    byte* mSlab;
+    std::size_t mSlabSize;
+    std::size_t mEntrySize;
+    unsigned mEntryCount;   // Power of 2
+
+    // Provided buffer ring over the slab
+    void* mBufferRing;
+    std::size_t mBufferRingSize;
+    unsigned short mBufferRingTail;
+    bool bMultishot;
+    bool bReceiveArmed;
+    bool bReceived;         // By the multishot recvmsg, else its EINVAL is a kernel without it
+    msghdr mReceiveMessage; // Name and control sizes of the multishot recvmsg
+
+    std::vector<PostedReceive> mPostedReceives;
+    std::vector<msghdr> mSendMessages;
+    std::vector<iovec> mSendIovecs;
+
+    std::vector<io_uring_cqe> mCompletedReceives; // While waiting for the sends
+#else
+protected:
+    int mFd;
+#endif
+};
+
+} // udp_network
@@ -0,0 +1,38 @@
+#include "udpnetwork_Log.h"
+
+#include <iostream>
+#include <mutex>
+
+using namespace udp_network;
+
+namespace
+{
+
+std::mutex g_logMutex;
+LogCb g_logCb;
+
+const char* levelToString(LogLevel level)
+{
+    switch (level)
+    {
+        case LL_ERROR: return "error";
+        case LL_INFO: return "info";
+        case LL_DEBUG: return "debug";
+    }
+    return "";
+}
+
+} // anonymous namespace
+
+void udp_network::setLogCallback(const LogCb& log)
+{
+    std::lock_guard<std::mutex> lock(g_logMutex);
+    g_logCb = log;
+}
+
+void udp_network::writeLog(LogLevel level, const std::string& message)
+{
+    std::lock_guard<std::mutex> lock(g_logMutex);
+    if (g_logCb) g_logCb(level, message);
+    else std::clog << "udp_network [" << levelToString(level) << "] " << message << '\n';
+}
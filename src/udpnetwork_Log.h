@@ -0,0 +1,63 @@
+#pragma once
+
+#include <functional>
+#include <sstream>
+#include <string>
+
+// Compile time log level, messages above the level compile to nothing.
+//   UDP_NETWORK_LOG_ERROR   : failures
+//   UDP_NETWORK_LOG_INFO    : connection events
+//   UDP_NETWORK_LOG_DEBUG   : per packet/tick messages (hot paths)
+
+#define UDP_NETWORK_LOG_LEVEL_NONE 0
+#define UDP_NETWORK_LOG_LEVEL_ERROR 1
+#define UDP_NETWORK_LOG_LEVEL_INFO 2
+#define UDP_NETWORK_LOG_LEVEL_DEBUG 3
+
+#ifndef UDP_NETWORK_LOG_LEVEL
+#define UDP_NETWORK_LOG_LEVEL UDP_NETWORK_LOG_LEVEL_INFO
+#endif
+
+namespace udp_network
+{
+
+enum LogLevel
+{
+    LL_ERROR = UDP_NETWORK_LOG_LEVEL_ERROR,
+    LL_INFO = UDP_NETWORK_LOG_LEVEL_INFO,
+    LL_DEBUG = UDP_NETWORK_LOG_LEVEL_DEBUG,
+};
+
+typedef std::function<void(LogLevel, const std::string&)> LogCb;
+
+// Replace the default output (std::clog, not flushed)
+void setLogCallback(const LogCb& log);
+void writeLog(LogLevel level, const std::string& message);
+
+} // udp_network
+
+
+#define UDP_NETWORK_LOG(_LEVEL, _MESSAGE) \
+do { \
+    std::ostringstream _udpnetwork_ss; \
+    _udpnetwork_ss << _MESSAGE; \
+    udp_network::writeLog(_LEVEL, _udpnetwork_ss.str()); \
+} while (0)
+
+#if UDP_NETWORK_LOG_LEVEL >= UDP_NETWORK_LOG_LEVEL_ERROR
+#define UDP_NETWORK_LOG_ERROR(_MESSAGE) UDP_NETWORK_LOG(udp_network::LL_ERROR, _MESSAGE)
+#else
+#define UDP_NETWORK_LOG_ERROR(_MESSAGE) do {} while (0)
+#endif
+
+#if UDP_NETWORK_LOG_LEVEL >= UDP_NETWORK_LOG_LEVEL_INFO
+#define UDP_NETWORK_LOG_INFO(_MESSAGE) UDP_NETWORK_LOG(udp_network::LL_INFO, _MESSAGE)
+#else
+#define UDP_NETWORK_LOG_INFO(_MESSAGE) do {} while (0)
+#endif
+
+#if UDP_NETWORK_LOG_LEVEL >= UDP_NETWORK_LOG_LEVEL_DEBUG
+#define UDP_NETWORK_LOG_DEBUG(_MESSAGE) UDP_NETWORK_LOG(udp_network::LL_DEBUG, _MESSAGE)
+#else
+#define UDP_NETWORK_LOG_DEBUG(_MESSAGE) do {} while (0)
+#endif
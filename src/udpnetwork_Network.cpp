@@ -1,27 +1,131 @@
 #include "udpnetwork_Network.h"
 #include "udpnetwork_Connection.h"
 
+#include "udpnetwork_Log.h"
+#include "udpnetwork_Trace.h"
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
 using namespace udp_network;
 
+namespace
+{
+
+const std::size_t MaxLargeBuffers = 8; // Reassembly buffers kept, the others are deleted
+const unsigned long ChallengeInterval = 250; // Ms, before a challenge is sent again or replaced
+
+// Answer to a migration challenge. Not a MAC: it keeps off-path senders that
+// guessed an id from moving the connection, the packets are not authenticated
+uint64_t getChallengeProof(uint64_t secret, uint64_t nonce)
+{
+    uint64_t x = secret ^ (nonce * 0x9e3779b97f4a7c15ull);
+    for (int i = 0; i < 2; i++)
+    {
+        x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27; x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        x += secret;
+    }
+    return x;
+}
+
+void write64(Buffer& b, uint64_t v)
+{
+    b << uint32_t(v >> 32) << uint32_t(v);
+}
+
+uint64_t read64(Buffer& b)
+{
+    uint32_t high, low;
+    b >> high >> low;
+    return (uint64_t(high) << 32) | low;
+}
+
+} // anonymous namespace
+
 Network::Network(
     const ConnectionRequestCb& connect,
     const DisconnectionCb& disconnect,
     unsigned long currentTime,
-    unsigned short port/* = 0*/)
+    unsigned short port/* = 0*/,
+    bool reusePort/* = false*/)
 
 :   mIoService(),
     mEndpoint(boost::asio::ip::udp::v4(), port),
-    mSocket(mIoService, mEndpoint),
+    mSocket(mIoService, mEndpoint, reusePort),
+    mConnectionPool(this),
+    mTickTimer(mIoService),
+    mTickRate(10),
+    mShard(0),
+    mShardCount(1),
+    mTimerWheel(currentTime),
     mConnectionRequestCb(connect),
     mDisconnectionCb(disconnect),
+    bMtuDiscovery(false),
+    mChannelTypes({CT_RELIABLE_ORDERED, CT_UNRELIABLE}),
+    mSendBudget(0),
+    mConnectionSendBudget(0),
+    mSendBudgetLeft(0),
+    mSendTick(0),
+    mDeferredBytes(0),
+    mDeferredPackets(0),
     mResponseTimeout(2000),
     mConnectionTimeout(5000),
     mPingRetryDelay(1000),
     mConnectionRequestRetryDelay(1000),
     mCurrentTime(currentTime),
-    bUpdateInProgress(false)
+    bUpdateInProgress(false),
+    bRunning(false)
+{
+    setBatchSize(1);
+}
+
+Network::~Network()
+{
+    mConnectionPool.clear(); // The connections release their buffers
+    for (auto b : mReceiveBuffers) delete b;
+    for (auto b : mSmallBuffers) delete b;
+    for (auto b : mBuffers) delete b;
+    for (auto b : mLargeBuffers) delete b;
+}
+
+void Network::setBatchSize(unsigned size)
 {
-    mSocket.non_blocking(true);
+    mSocket.setBatchSize(size);
+    mReceiveEndpoints.resize(mSocket.getBatchSize());
+}
+
+bool Network::setMtuDiscovery(bool enable)
+{
+    if (!mSocket.setMtuDiscovery(enable)) return false;
+    bMtuDiscovery = enable;
+    return true;
+}
+
+bool Network::setShard(unsigned shard, unsigned count)
+{
+    if (shard >= count || count > 0x10000) throw std::runtime_error("UDPNETWORK invalid shard!");
+
+    mShard = shard;
+    mShardCount = count;
+    return mSocket.setShardSteering(count);
+}
+
+ChannelId Network::addChannel(ChannelType type)
+{
+    if (mChannelTypes.size() > 255) throw std::runtime_error("UDPNETWORK too many channels!");
+
+    mChannelTypes.push_back(type);
+    return mChannelTypes.size() - 1;
+}
+
+void Network::setSendBudget(unsigned bytes, unsigned connectionBytes/* = 0*/)
+{
+    mSendBudget = bytes;
+    mConnectionSendBudget = connectionBytes;
+    mSendBudgetLeft = bytes;
 }
 
 Connection* Network::connect(const std::string& addr, const std::string& port)
@@ -40,122 +144,344 @@ void Network::disconnect(Connection* c)
 
 void Network::update(unsigned long currentTime)
 {
-    std::cout<<__PRETTY_FUNCTION__<<std::endl;
     bUpdateInProgress = true;
     mCurrentTime = currentTime;
-    boost::system::error_code errorCode;
-    boost::asio::ip::udp::endpoint endpoint;
+
+    updateConnections(currentTime);
+    receive(currentTime);
+
+    bUpdateInProgress = false;
+    runQueuedJobs();
+
+    // Run the posted jobs
+    mIoService.reset();
+    mIoService.poll();
+}
+
+void Network::run(const TimeCb& time, unsigned tickRate/* = 10*/)
+{
+    mTimeCb = time;
+    mTickRate = tickRate;
+    bRunning = true;
+
+    waitReadable();
+    waitTick();
+
+    mIoService.reset();
+    mIoService.run();
+
+    bRunning = false;
+}
+
+void Network::stop()
+{
+    // Posted so that a 'stop' called before 'run' is not lost
+    post([this]() { mIoService.stop(); });
+}
+
+void Network::post(const std::function<void()>& job)
+{
+    mIoService.post(job);
+}
+
+void Network::waitReadable()
+{
+    mSocket.asyncWaitReadable(std::bind(&Network::handleReadable, this, std::placeholders::_1));
+}
+
+void Network::handleReadable(const boost::system::error_code& error)
+{
+    if (error) return;
+
+    bUpdateInProgress = true;
+    mCurrentTime = mTimeCb();
+
+    receive(mCurrentTime);
+
+    // Send the replies (acks, pongs, messages written from the callback)
+    sendPending(mCurrentTime);
+    for (auto c : mReceivingConnections) c->clear();
+
+    bUpdateInProgress = false;
+    runQueuedJobs();
+
+    waitReadable();
+}
+
+void Network::waitTick()
+{
+    mTickTimer.expires_from_now(std::chrono::milliseconds(mTickRate));
+    mTickTimer.async_wait(std::bind(&Network::handleTick, this, std::placeholders::_1));
+}
+
+void Network::handleTick(const boost::system::error_code& error)
+{
+    if (error) return;
+
+    bUpdateInProgress = true;
+    mCurrentTime = mTimeCb();
+
+    updateConnections(mCurrentTime);
+
+    bUpdateInProgress = false;
+    runQueuedJobs();
+
+    waitTick();
+}
+
+void Network::updateConnections(unsigned long currentTime)
+{
+    // New tick, refill the send budget. The connections refill theirs when they send.
+    ++mSendTick;
+    mSendBudgetLeft = mSendBudget;
+    mDeferredBytes = 0;
+    mDeferredPackets = 0;
 
     ////////////////////////
-    // Send packet for all connection
+    // Connections with an expired timer
     ////////////////////////
-    for (auto cit = mConnections.begin(); cit != mConnections.end(); )
+    mExpiredTimers.clear();
+    mTimerWheel.advance(currentTime, mExpiredTimers);
+
+    for (auto node : mExpiredTimers)
     {
-        Connection* c = cit->second;
+        ConnectionState* s = (ConnectionState*)node->owner;
+        Connection* c = s->connection;
 
-        if (!c->isConnected() &&
-            c->getSentTime() + mConnectionRequestRetryDelay <= currentTime)
+        if (!s->connected &&
+            s->sentTime + mConnectionRequestRetryDelay <= currentTime)
         {
             requestConnection(c);
         }
-        else if (c->getHeartbeat() + mConnectionTimeout <= currentTime)
+        else if (s->heartbeat + mConnectionTimeout <= currentTime)
         {
             destroyConnection(c, "connection timeout");
-            ++cit;
-            //c->clear();
             continue;
         }
-        else if (c->getHeartbeat() + mResponseTimeout <= currentTime &&
-                 c->getPingSentTime() + mPingRetryDelay <= currentTime)
+        else if (s->heartbeat + mResponseTimeout <= currentTime &&
+                 s->pingSentTime + mPingRetryDelay <= currentTime)
         {
             c->sendPing(currentTime);
         }
 
-        c->send(currentTime, mSocket);
-        ++cit;
+        c->expireReassemblies(currentTime);
+        addPendingSend(c); // Resend, then reschedule
     }
 
-    // Send packet to unconnected endpoint
-    for (auto& b : mAddressedPackets)
+    sendPending(currentTime);
+
+    // Release the buffers received during the last update
+    for (auto c : mReceivingConnections) c->clear();
+}
+
+void Network::addPendingSend(Connection* c)
+{
+    if (c->mState->pendingSend) return;
+    c->mState->pendingSend = true;
+    mPendingSendConnections.push_back(c);
+}
+
+void Network::sendPending(unsigned long currentTime)
+{
+    mScheduledPackets.clear();
+    for (auto c : mPendingSendConnections) c->schedule(currentTime, mSocket, mScheduledPackets);
+
+    // The most important first, whatever the connection
+    std::stable_sort(mScheduledPackets.begin(), mScheduledPackets.end(),
+        [](const ScheduledPacket& a, const ScheduledPacket& b) { return a.priority > b.priority; });
+
+    for (auto& p : mScheduledPackets)
     {
-        std::cout<<"Sending addressed packet"<<std::endl;
-        mSocket.send_to(
-            boost::asio::buffer(b.buffer.data(), b.buffer.size()),
-            b.endpoint, 0, errorCode);
+        unsigned size = p.buffer->size();
+        if ((mSendBudget && size > mSendBudgetLeft) ||
+            (mConnectionSendBudget && size > p.connection->mSendBudget))
+        {
+            p.connection->defer(p.buffer);
+            mDeferredBytes += size;
+            ++mDeferredPackets;
+            continue;
+        }
+
+        if (p.connection->sendScheduled(p.buffer, currentTime, mSocket) && mSendBudget) mSendBudgetLeft -= size;
     }
-    mAddressedPackets.clear();
 
-    ////////////////////////
-    // Receive
-    ////////////////////////
-    Buffer* buffer = newBuffer();
-    while (42)
+    for (auto c : mPendingSendConnections) c->endSend(currentTime, mSocket);
+
+    sendAddressedPackets();
+
+    // Queued datagrams reference the packets buffers, clear them once sent
+    for (auto c : mPendingSendConnections)
     {
+        c->clear();
+        c->mState->pendingSend = false;
+        scheduleTimer(c, currentTime);
+    }
+    mPendingSendConnections.clear();
+}
 
-        buffer->size(mSocket.receive_from(
-            boost::asio::buffer(buffer->data(), Buffer::Size),
-            endpoint, 0, errorCode));
+void Network::scheduleTimer(Connection* c, unsigned long currentTime)
+{
+    ConnectionState* s = c->mState;
+    unsigned long next = s->heartbeat + mConnectionTimeout;
+
+    if (!s->connected)
+        next = std::min<unsigned long>(next, s->sentTime + mConnectionRequestRetryDelay);
 
-        if (!buffer->size()) break; // Nothing was received
+    next = std::min<unsigned long>(next, std::max<unsigned long>(
+        s->heartbeat + mResponseTimeout,
+        s->pingSentTime + mPingRetryDelay));
 
-        std::cout<<"Packet received"<<std::endl;
+    next = std::min(next, c->getNextResendTime());
+    next = std::min(next, c->getNextMtuProbeTime());
+    next = std::min(next, c->getNextReassemblyTimeout());
 
-        Connection* connection = getConnection(endpoint);
-        if (connection) 
+    mTimerWheel.schedule(&s->timer, next);
+}
+
+void Network::sendAddressedPackets()
+{
+    // Send packet to unconnected endpoint
+    for (auto& p : mAddressedPackets)
+    {
+        mSocket.send(*p.buffer, p.endpoint);
+    }
+
+    mSocket.flush();
+    for (auto& p : mAddressedPackets) releaseBuffer(p.buffer);
+    mAddressedPackets.clear();
+}
+
+void Network::receive(unsigned long currentTime)
+{
+    mReceivingConnections.clear();
+
+    std::size_t batchSize = mSocket.getBatchSize();
+    while (mReceiveBuffers.size() < batchSize) mReceiveBuffers.push_back(newBuffer());
+
+    while (42)
+    {
+        std::size_t received = mSocket.receive(&mReceiveBuffers[0], &mReceiveEndpoints[0], batchSize);
+
+        for (std::size_t i = 0; i < received; i++)
         {
-            std::cout<<"Ack received: "<<(unsigned)buffer->getAckCount()<<std::endl;
-            if (buffer->hasAck())
+            if (handleBuffer(mReceiveBuffers[i], mReceiveEndpoints[i], currentTime))
             {
-                for (unsigned char i = 0; i < buffer->getAckCount(); i++)
-                {
-                    std::cout<<"Ack received: id:"<<buffer->getAck(i)<<std::endl;
-                    connection->ack(buffer->getAck(i));
-                }
+                mReceiveBuffers[i] = newBuffer(); // Get a new one
             }
+            else mReceiveBuffers[i]->clear();
         }
 
-        switch (buffer->getType())
+        if (received < batchSize) break; // Nothing left to receive
+    }
+
+    // Keep the receive block for the next update
+    while (mReceiveBuffers.size() > batchSize)
+    {
+        releaseBuffer(mReceiveBuffers.back());
+        mReceiveBuffers.pop_back();
+    }
+}
+
+// Return true if the buffer ownership was transfered
+bool Network::handleBuffer(Buffer* buffer, const boost::asio::ip::udp::endpoint& endpoint, unsigned long currentTime)
+{
+    if (buffer->size() < PacketHeaderSize) return false; // Invalid packet
+
+    // Known connections are found with the id written in the header, the
+    // endpoint is only needed during the handshake
+    Connection* connection = nullptr;
+    ConnectionId id = buffer->getConnectionId();
+    if (id != InvalidConnectionId) connection = getConnection(id);
+
+    if (connection)
+    {
+        // NAT rebinding, or a guessed id: nothing is handled from the new
+        // address until it answers a challenge
+        if (connection->getEndpoint() != endpoint)
         {
-            case PT_PING:
-                if (connection) connection->handlePing();
-                break;
+            challengeMigration(buffer, connection, endpoint, currentTime);
+            return false;
+        }
+    }
+    else connection = getConnection(endpoint);
+
+    UDP_NETWORK_TRACE(TE_PACKET_RECEIVED, connection, buffer->getType(), buffer->size());
+
+    if (connection) 
+    {
+        mReceivingConnections.push_back(connection);
+        if (buffer->hasAck()) connection->ack(buffer->getAck(), buffer->getAckBits(), currentTime);
+    }
+
+    switch (buffer->getType())
+    {
+        case PT_PING:
+            if (connection) connection->handlePing();
+            break;
+
+        case PT_PONG:
+            if (connection) connection->handlePong(currentTime);
+            break;
 
-            case PT_PONG:
-                if (connection) connection->handlePong(currentTime);
-                break;
+        case PT_ACK:
+            if (connection) connection->mState->heartbeat = currentTime;
+            break;
 
-            case PT_CONNECTION:
-                handleConnection(buffer, endpoint);
-                break;
+        case PT_MTU_PROBE:
+            if (connection) connection->handleMtuProbe(*buffer, currentTime);
+            break;
+
+        case PT_CONNECTION:
+            handleConnection(buffer, connection, endpoint);
+            break;
 
-            case PT_DATA:
-                if (connection)
+        case PT_DATA:
+        case PT_MESSAGE:
+        case PT_FRAGMENT:
+            if (connection)
+            {
+                // The buffer ownership is transfered to the connection
+                auto& received = connection->getIncomingBuffers();
+                std::size_t first = received.size();
+                connection->addIncomingBuffer(buffer, currentTime);
+
+                if (mMessageCb)
                 {
-                    // The buffer ownership is transfered to the connection
-                    // TODO ???? eliminate this and use a callback for the connection to parse the packet ???????
-                    connection->addIncomingBuffer(buffer, currentTime);
-                    buffer = newBuffer(); // Get a new one
+                    // May be more than one if early packets were waiting for this one
+                    for (std::size_t i = first; i < received.size(); i++)
+                    {
+                        auto& b = *received[i];
+                        if (b.getType() != PT_MESSAGE)
+                        {
+                            mMessageCb(connection, b);
+                            continue;
+                        }
+
+                        // Once per message, then left for 'getIncomingBuffers'
+                        while (b.nextMessage()) mMessageCb(connection, b);
+                        b.rewind();
+                    }
                 }
-                break;
+                return true;
+            }
+            break;
 
-            default:
-                break;
-        }
+        default:
+            break;
     }
-    releaseBuffer(buffer);
 
-    bUpdateInProgress = false;
-    runQueuedJobs();
+    return false;
 }
 
-void Network::handleConnection(Buffer* buffer, const boost::asio::ip::udp::endpoint& endpoint)
+void Network::handleConnection(Buffer* buffer, Connection* c, const boost::asio::ip::udp::endpoint& endpoint)
 {
     std::string info;
     switch (buffer->readByte())
     {
         case CM_REQUEST:
         {
-            auto c = createConnection(endpoint);
+            c = createConnection(endpoint);
+            *buffer >> c->mState->remoteId;
 
             if (!mConnectionRequestCb(c, info))
             {
@@ -166,18 +492,27 @@ void Network::handleConnection(Buffer* buffer, const boost::asio::ip::udp::endpo
             break;
         }
         case CM_ACCEPT:
-            if (auto c = getConnection(endpoint))
+            if (c && !c->isConnected())
+            {
+                *buffer >> c->mState->remoteId;
+                c->mSecret = read64(*buffer);
                 c->setConnected(true);
+            }
             break;
 
         case CM_REFUSE:
-            if (auto c = getConnection(endpoint))
-                destroyConnection(c);
+            if (c) destroyConnection(c);
             break;
 
         case CM_DISCONNECT:
-            if (auto c = getConnection(endpoint))
-                destroyConnection(c);
+            if (c) destroyConnection(c);
+            break;
+
+        case CM_CHALLENGE:
+            if (c && c->isConnected()) answerChallenge(buffer, c);
+            break;
+
+        default: // Late challenge responses
             break;
     }
 }
@@ -189,8 +524,15 @@ Connection* Network::createConnection(const boost::asio::ip::udp::endpoint& endp
         return c; // Already connected
     }
 
-    auto c = new Connection(this, endpoint, mCurrentTime);
+    auto c = mConnectionPool.acquire(endpoint, mCurrentTime);
+    c->mState->id = allocateConnectionId(c);
+    c->mSecret = random64(); // Replaced by the accepting one on the requesting side
+    if (!mCongestionControlFactory) c->setCongestionControl(nullptr);
+    else if (!c->getCongestionControl()) c->setCongestionControl(mCongestionControlFactory());
+    c->bMtuDiscovery = bMtuDiscovery;
     mConnections.insert({endpoint, c});
+    scheduleTimer(c, mCurrentTime);
+    UDP_NETWORK_TRACE(TE_CONNECTION_CREATED, c, 0, 0);
     return c;
 }
 
@@ -198,10 +540,14 @@ void Network::destroyConnection(Connection* c, const std::string& info/* = ""*/)
 {
     if (bUpdateInProgress)
     {
+        if (c->mState->closing) return; // Already queued
+        c->mState->closing = true;
         mQueuedJobs.push_back(std::bind(&Network::destroyConnection,this,c,info));
         return;
     }
 
+    UDP_NETWORK_LOG_INFO("Connection closed -- " << c->printInfo() << (info.empty() ? "" : " -- ") << info);
+    UDP_NETWORK_TRACE(TE_CONNECTION_DESTROYED, c, 0, 0);
     mDisconnectionCb(c);
 
     auto b = send(c->getEndpoint());
@@ -209,8 +555,19 @@ void Network::destroyConnection(Connection* c, const std::string& info/* = ""*/)
     b->writeByte(CM_DISCONNECT);
     b->writeString(info);
 
+    mTimerWheel.cancel(&c->mState->timer);
+    if (c->mState->pendingSend)
+    {
+        mPendingSendConnections.erase(std::find(
+            mPendingSendConnections.begin(), mPendingSendConnections.end(), c));
+    }
+    mReceivingConnections.erase(
+        std::remove(mReceivingConnections.begin(), mReceivingConnections.end(), c),
+        mReceivingConnections.end());
+
     mConnections.erase(c->getEndpoint());
-    delete c;
+    releaseConnectionId(c->getId());
+    mConnectionPool.release(c);
 }
 
 void Network::acceptConnection(Connection* c)
@@ -218,6 +575,8 @@ void Network::acceptConnection(Connection* c)
     auto b = c->send();
     b->setType(PT_CONNECTION);
     b->writeByte(CM_ACCEPT);
+    *b << c->getId();
+    write64(*b, c->mSecret);
     c->setConnected(true);
 }
 
@@ -231,10 +590,11 @@ void Network::refuseConnection(const boost::asio::ip::udp::endpoint& endpoint, c
 
 void Network::requestConnection(Connection* c)
 {
-    std::cout<<"Requesting connection -- "<<c->printInfo()<<std::endl;
+    UDP_NETWORK_LOG_INFO("Requesting connection -- " << c->printInfo());
     auto b = c->send();
     b->setType(PT_CONNECTION);
     b->writeByte(CM_REQUEST);
+    *b << c->getId();
 }
 
 Connection* Network::getConnection(const boost::asio::ip::udp::endpoint& endpoint)
@@ -244,19 +604,128 @@ Connection* Network::getConnection(const boost::asio::ip::udp::endpoint& endpoin
     return it->second;
 }
 
+Connection* Network::getConnection(ConnectionId id)
+{
+    uint16_t index = id & 0xffff;
+    if (index % mShardCount != mShard) return nullptr; // Another shard
+    index /= mShardCount;
+    if (index >= mConnectionSlots.size()) return nullptr;
+
+    auto& slot = mConnectionSlots[index];
+    if (slot.tag != (id >> 16)) return nullptr; // Stale or guessed id
+    return slot.connection;
+}
+
+void Network::challengeMigration(Buffer* buffer, Connection* c, const boost::asio::ip::udp::endpoint& endpoint, unsigned long currentTime)
+{
+    if (!c->isConnected()) return; // No secret yet
+
+    if (buffer->getType() == PT_CONNECTION && buffer->readByte() == CM_CHALLENGE_RESPONSE)
+    {
+        if (buffer->size() < PacketHeaderSize + 17) return;
+        uint64_t nonce = read64(*buffer);
+        uint64_t proof = read64(*buffer);
+        if (!c->mChallenge || nonce != c->mChallenge || endpoint != c->mChallengeEndpoint) return;
+        if (proof != getChallengeProof(c->mSecret, nonce)) return;
+
+        c->mChallenge = 0;
+        migrateConnection(c, endpoint);
+        return;
+    }
+
+    // One address challenged at a time, sent again or replaced after a while
+    if (c->mChallenge && currentTime - c->mChallengeTime < ChallengeInterval) return;
+    if (!c->mChallenge || c->mChallengeEndpoint != endpoint)
+    {
+        do c->mChallenge = random64(); while (!c->mChallenge);
+        c->mChallengeEndpoint = endpoint;
+    }
+    c->mChallengeTime = currentTime;
+
+    auto b = send(endpoint);
+    b->setType(PT_CONNECTION);
+    b->setConnectionId(c->getRemoteId());
+    b->writeByte(CM_CHALLENGE);
+    write64(*b, c->mChallenge);
+}
+
+void Network::answerChallenge(Buffer* buffer, Connection* c)
+{
+    if (buffer->size() < PacketHeaderSize + 9) return;
+    uint64_t nonce = read64(*buffer);
+
+    // To the known address whatever the sender: the peer sees it come from our
+    // new address, and a third party sending the challenge never gets the proof
+    auto b = send(c->getEndpoint());
+    b->setType(PT_CONNECTION);
+    b->setConnectionId(c->getRemoteId());
+    b->writeByte(CM_CHALLENGE_RESPONSE);
+    write64(*b, nonce);
+    write64(*b, getChallengeProof(c->mSecret, nonce));
+}
+
+void Network::migrateConnection(Connection* c, const boost::asio::ip::udp::endpoint& endpoint)
+{
+    if (getConnection(endpoint)) return; // Address already in use by another connection
+
+    UDP_NETWORK_LOG_INFO("Connection migrated -- " << c->printInfo() << " -> " << endpoint);
+    mConnections.erase(c->getEndpoint());
+    c->mEndpoint = endpoint;
+    mConnections.insert({endpoint, c});
+}
+
+ConnectionId Network::allocateConnectionId(Connection* c)
+{
+    uint16_t index;
+    if (!mFreeConnectionSlots.empty())
+    {
+        index = mFreeConnectionSlots.back();
+        mFreeConnectionSlots.pop_back();
+    }
+    else if (mConnectionSlots.size() * mShardCount + mShard <= 0xffff)
+    {
+        index = mConnectionSlots.size();
+        mConnectionSlots.push_back({nullptr, 0});
+    }
+    else return InvalidConnectionId; // Full, the peer will be found by its endpoint
+
+    // A new random tag, so the ids can't be guessed from the previous ones
+    auto& slot = mConnectionSlots[index];
+    uint16_t tag;
+    do tag = uint16_t(mRandom()); while (!tag || tag == slot.tag);
+    slot.connection = c;
+    slot.tag = tag;
+    return (ConnectionId(tag) << 16) | (index * mShardCount + mShard);
+}
+
+void Network::releaseConnectionId(ConnectionId id)
+{
+    if (id == InvalidConnectionId) return;
+
+    uint16_t index = (id & 0xffff) / mShardCount;
+    auto& slot = mConnectionSlots[index];
+    slot.connection = nullptr;
+    mFreeConnectionSlots.push_back(index);
+}
+
+uint64_t Network::random64()
+{
+    return (uint64_t(mRandom()) << 32) | uint32_t(mRandom());
+}
+
 Buffer* Network::send(const boost::asio::ip::udp::endpoint& endpoint)
 {
-    mAddressedPackets.emplace_back(endpoint);
-    return &mAddressedPackets.back().buffer;
+    mAddressedPackets.emplace_back(newBuffer(), endpoint);
+    return mAddressedPackets.back().buffer;
 }
 
 std::string Network::getStatus()
 {
     std::stringstream ss;
-    if (mSocket.is_open())
+    if (mSocket.isOpen())
     {
-        ss << "Socket opened on address: " << mSocket.local_endpoint().address().to_string();
-        ss << ", port: " << mSocket.local_endpoint().port();
+        ss << "Socket opened on address: " << mSocket.getLocalEndpoint().address().to_string();
+        ss << ", port: " << mSocket.getLocalEndpoint().port();
     }
     else ss << "Socket is not opened";
     return ss.str();
@@ -264,18 +733,37 @@ std::string Network::getStatus()
 
 bool Network::isUp()
 {
-    return mSocket.is_open();
+    return mSocket.isOpen();
 }
 
-Buffer* Network::newBuffer()
+Buffer* Network::newBuffer(std::size_t capacity/* = Buffer::MaxSize*/)
 {
-    //std::cout<<"num of buffers:"<<mBuffers.size()<<std::endl;
     Buffer* ret = nullptr;
-    if (mBuffers.empty()) ret = new Buffer();
+    if (capacity > Buffer::MaxSize)
+    {
+        for (std::size_t i = 0; i < mLargeBuffers.size(); i++)
+        {
+            if (mLargeBuffers[i]->capacity() < capacity) continue;
+            ret = mLargeBuffers[i];
+            mLargeBuffers[i] = mLargeBuffers.back();
+            mLargeBuffers.pop_back();
+            ret->clear();
+            return ret;
+        }
+
+        // Power of 2 capacities, for the next ones to fit
+        std::size_t rounded = Buffer::MaxSize;
+        while (rounded < capacity) rounded *= 2;
+        return new Buffer(rounded);
+    }
+
+    bool small = capacity <= Buffer::SmallSize;
+    auto& pool = small ? mSmallBuffers : mBuffers;
+    if (pool.empty()) ret = new Buffer(small ? Buffer::SmallSize : Buffer::MaxSize);
     else
     {
-        ret = mBuffers.back();
-        mBuffers.pop_back();
+        ret = pool.back();
+        pool.pop_back();
         ret->clear();
     }
     return ret;
@@ -283,7 +771,10 @@ Buffer* Network::newBuffer()
 
 void Network::releaseBuffer(Buffer* b)
 {
-    mBuffers.push_back(b);
+    if (b->capacity() <= Buffer::SmallSize) mSmallBuffers.push_back(b);
+    else if (b->capacity() <= Buffer::MaxSize) mBuffers.push_back(b);
+    else if (mLargeBuffers.size() < MaxLargeBuffers) mLargeBuffers.push_back(b);
+    else delete b;
 }
 
 
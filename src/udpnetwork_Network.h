@@ -1,12 +1,19 @@
 #pragma once
 
+#include "udpnetwork_Channel.h"
 #include "udpnetwork_Common.h"
+#include "udpnetwork_CongestionControl.h"
+#include "udpnetwork_ConnectionPool.h"
 #include "udpnetwork_Packet.h"
+#include "udpnetwork_Socket.h"
+#include "udpnetwork_TimerWheel.h"
 
 #include <boost/asio/ip/udp.hpp>
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <deque>
 #include <functional>
+#include <random>
 #include <unordered_map>
 
 namespace udp_network
@@ -14,6 +21,13 @@ namespace udp_network
 
 class Connection;
 
+struct ScheduledPacket
+{
+    Connection* connection;
+    Buffer* buffer;
+    Priority priority;
+};
+
 class Network
 {
 friend class Connection;
@@ -21,50 +35,186 @@ friend class Connection;
 public:
     typedef std::function<bool(Connection*, const std::string&)> ConnectionRequestCb;
     typedef std::function<void(Connection*)> DisconnectionCb;
+    typedef std::function<void(Connection*, Buffer&)> MessageCb;
+    typedef std::function<void(Connection*, PacketId)> AckCb;
+    typedef std::function<unsigned long()> TimeCb;
+    typedef std::function<CongestionControl*()> CongestionControlFactory;
 
     Network(
         const ConnectionRequestCb& connect,
         const DisconnectionCb& disconnect,
         unsigned long currentTime,
-        unsigned short port = 0);
+        unsigned short port = 0,
+        bool reusePort = false);
+    ~Network();
 
+    // Polling mode: send, resend and receive everything pending
     void update(unsigned long currentTime);
 
+    // Event driven mode: block on the io_service until 'stop' is called.
+    // Packets are handled as soon as the socket is readable (epoll), replies
+    // to the connections that received packets are sent right away and the
+    // timeouts, pings and resends are checked every 'tickRate' milliseconds.
+    // The received packets are only available from the message callback.
+    void run(const TimeCb& time, unsigned tickRate = 10);
+    void stop();
+    bool isRunning() { return bRunning; }
+
+    // Run 'job' on the network thread (thread safe).
+    // In polling mode the jobs are run at the end of 'update'.
+    void post(const std::function<void()>& job);
+
     std::string getStatus();
     bool isUp();
+    boost::asio::ip::udp::endpoint getLocalEndpoint() { return mSocket.getLocalEndpoint(); }
 
     Connection* connect(const std::string& address, const std::string& port);
     void disconnect(Connection* connection);
 
+    // Number of datagrams sent/received per syscall (sendmmsg/recvmmsg).
+    // A batch size of 1 disable batching.
+    void setBatchSize(unsigned size);
+    unsigned getBatchSize() { return mSocket.getBatchSize(); }
+
+    // Use the io_uring backend (Linux), return false if not available
+    bool setIoUring(bool enable) { return mSocket.setIoUring(enable); }
+
+    // Coalesce same sized datagrams with UDP GSO and split GRO received ones,
+    // return false if not available
+    bool setSegmentationOffload(bool enable) { return mSocket.setSegmentationOffload(enable); }
+
+    // Controller created for each new connection (reliable window and pacing),
+    // none by default. Pooled connections keep theirs, reset.
+    void setCongestionControl(const CongestionControlFactory& factory) { mCongestionControlFactory = factory; }
+
+    // Give the paced datagrams a transmit time (SO_TXTIME) instead of holding
+    // them until the next update, return false if not available
+    bool setTxTime(bool enable) { return mSocket.setTxTime(enable); }
+
+    // Probe the path MTU of the new connections, to send datagrams larger than
+    // 'Buffer::Size' (up to 'Buffer::MaxSize'). Return false if not available:
+    // the socket must set the don't fragment bit and ignore the kernel estimate.
+    bool setMtuDiscovery(bool enable);
+
+    // Shard 'shard' of 'count' networks on a SO_REUSEPORT port (see 'ShardedNetwork'):
+    // the connection ids carry the shard and the datagrams are steered to it by
+    // their id (Linux), so a connection keeps its shard when its address changes.
+    // Set before connecting. Return false if the steering is not available, the
+    // datagrams then go to a shard by their address and migrations are lost.
+    bool setShard(unsigned shard, unsigned count);
+
+    // Every connection has the default reliable ordered and unreliable channels
+    // (0 and 1), add the others before connecting, in the same order on both sides.
+    ChannelId addChannel(ChannelType type);
+    const std::vector<ChannelType>& getChannelTypes() { return mChannelTypes; }
+
+    // Bytes of data packets sent per tick (update, or 'run' tick), for all the
+    // connections and for each one, 0 for no limit. Past that the packets are
+    // deferred to the next tick, the highest priority first whatever the
+    // connection. A budget should fit a datagram ('Buffer::MaxSize').
+    // The control packets (acks, pings, connection) are not limited.
+    void setSendBudget(unsigned bytes, unsigned connectionBytes = 0);
+
+    // Deferred by the send budgets during the current tick
+    unsigned getDeferredBytes() { return mDeferredBytes; }
+    unsigned getDeferredPackets() { return mDeferredPackets; }
+
+    // Called for each raw data packet and each message as it is received, in
+    // order for reliable packets. The buffer is positioned on the message.
+    // The packets are still available from 'Connection::getIncomingBuffers'.
+    void setMessageCallback(const MessageCb& message) { mMessageCb = message; }
+
+    // Called when a reliable packet is acked, with its 'Buffer::getId'. The id
+    // is given once the packet enters the window (see 'Buffer::hasId').
+    void setAckCallback(const AckCb& ack) { mAckCb = ack; }
+
 protected:
     Connection* createConnection(const boost::asio::ip::udp::endpoint& endpoint);
     void destroyConnection(Connection*, const std::string& info = "");
     Connection* getConnection(const boost::asio::ip::udp::endpoint& endpoint);
+    Connection* getConnection(ConnectionId id);
+    void migrateConnection(Connection*, const boost::asio::ip::udp::endpoint& endpoint);
+    void challengeMigration(Buffer*, Connection*, const boost::asio::ip::udp::endpoint& endpoint, unsigned long currentTime);
+    void answerChallenge(Buffer*, Connection*);
+
+    ConnectionId allocateConnectionId(Connection*);
+    void releaseConnectionId(ConnectionId id);
+    uint64_t random64();
 
-    void handleConnection(Buffer*, const boost::asio::ip::udp::endpoint& endpoint);
+    void handleConnection(Buffer*, Connection*, const boost::asio::ip::udp::endpoint& endpoint);
     void acceptConnection(Connection*);
     void requestConnection(Connection*);
     void refuseConnection(const boost::asio::ip::udp::endpoint& endpoint, const std::string& info = "");
 
+    void updateConnections(unsigned long currentTime);
+    void addPendingSend(Connection*);
+    void sendPending(unsigned long currentTime);
+    void scheduleTimer(Connection*, unsigned long currentTime);
+    void sendAddressedPackets();
+    void receive(unsigned long currentTime);
+    bool handleBuffer(Buffer*, const boost::asio::ip::udp::endpoint& endpoint, unsigned long currentTime);
+
     void runQueuedJobs();
 
+    void waitReadable();
+    void handleReadable(const boost::system::error_code& error);
+    void waitTick();
+    void handleTick(const boost::system::error_code& error);
+
     Buffer* send(const boost::asio::ip::udp::endpoint& endpoint); // AddressedPacket
 
     // NOTE: 'releaseBuffer' must be called before the returned buffer is discarded to avoid memory leak
-    Buffer* newBuffer();
+    // One pool per size class: small (control packets), datagram, and large (reassembly, kept small).
+    Buffer* newBuffer(std::size_t capacity = Buffer::MaxSize);
     void releaseBuffer(Buffer*);
 
     boost::asio::io_service mIoService;
     boost::asio::ip::udp::endpoint mEndpoint;
-    boost::asio::ip::udp::socket mSocket;
+    Socket mSocket;
+    std::vector<Buffer*> mSmallBuffers;
     std::vector<Buffer*> mBuffers;
-
-    std::unordered_map<boost::asio::ip::udp::endpoint, Connection*> mConnections;
+    std::vector<Buffer*> mLargeBuffers;
+    ConnectionPool mConnectionPool; // After the buffers, connections release theirs when destroyed
+    std::vector<Buffer*> mReceiveBuffers;
+    std::vector<boost::asio::ip::udp::endpoint> mReceiveEndpoints;
+    std::vector<Connection*> mReceivingConnections;
+    boost::asio::steady_timer mTickTimer;
+    TimeCb mTimeCb;
+    unsigned mTickRate;
+
+    struct ConnectionSlot
+    {
+        Connection* connection;
+        uint16_t tag; // Random per allocation, never 0
+    };
+
+    std::unordered_map<boost::asio::ip::udp::endpoint, Connection*> mConnections; // Handshake and fallback lookup
+    std::vector<ConnectionSlot> mConnectionSlots; // Indexed by the connection id
+    std::vector<uint16_t> mFreeConnectionSlots;
+    unsigned mShard;      // Slot index of an id: index * 'mShardCount' + 'mShard'
+    unsigned mShardCount;
+    std::random_device mRandom; // Connection ids, handshake secrets and challenges
+    std::vector<Connection*> mPendingSendConnections; // Packets queued
+    std::vector<ScheduledPacket> mScheduledPackets;
+    TimerWheel mTimerWheel;
+    std::vector<TimerNode*> mExpiredTimers;
     std::vector<AddressedPacket> mAddressedPackets;
     std::list<std::function<void()>> mQueuedJobs;
 
     ConnectionRequestCb mConnectionRequestCb;
     DisconnectionCb mDisconnectionCb;
+    MessageCb mMessageCb;
+    AckCb mAckCb;
+    CongestionControlFactory mCongestionControlFactory;
+    bool bMtuDiscovery;
+    std::vector<ChannelType> mChannelTypes;
+
+    unsigned mSendBudget;
+    unsigned mConnectionSendBudget;
+    unsigned mSendBudgetLeft;
+    unsigned mSendTick;
+    unsigned mDeferredBytes;
+    unsigned mDeferredPackets;
 
     unsigned mResponseTimeout;
     unsigned mConnectionTimeout;
@@ -73,6 +223,7 @@ protected:
     unsigned mCurrentTime;
 
     bool bUpdateInProgress;
+    bool bRunning;
 };
 
 } // udp_network
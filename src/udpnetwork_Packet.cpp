@@ -1,12 +1,20 @@
 #include "udpnetwork_Packet.h"
+#include <cmath>
+#include <cstring>
 #include <stdexcept>
 
 using namespace udp_network;
 
+const unsigned Buffer::InvalidBoolByteIt;
+const std::size_t Buffer::Size;
+const std::size_t Buffer::MaxSize;
+const std::size_t Buffer::SmallSize;
+const std::size_t Buffer::MaxMessageSize;
+
 
 #define UDP_NETWORK_CHECK_BUFFER_OVERFLOW(_TYPE) \
 { \
-    if (mSize + sizeof(_TYPE) >= mData.size()-1) throw std::runtime_error("UDPNETWORK buffer overflow!"); \
+    if (mSize + sizeof(_TYPE) > mLimit) throw std::runtime_error("UDPNETWORK buffer overflow!"); \
 } 
 
 
@@ -66,6 +74,7 @@ byte Buffer::getType() const
 void Buffer::setId(PacketId id)
 {
     *(PacketId*)&mData[PacketIdPosition] = id;
+    bHasId = true;
 }
 
 PacketId Buffer::getId() const
@@ -73,17 +82,35 @@ PacketId Buffer::getId() const
     return *(PacketId*)&mData[PacketIdPosition];
 }
 
-// Should be called after the data writing stage
-void Buffer::addAck(PacketId id)
+void Buffer::setConnectionId(ConnectionId id)
+{
+    memcpy(&mData[PacketConnectionIdPosition], &id, sizeof(id));
+}
+
+ConnectionId Buffer::getConnectionId() const
 {
-    write16(&id);   
-    ++mNumberOfAck;
+    ConnectionId id;
+    memcpy(&id, &mData[PacketConnectionIdPosition], sizeof(id));
+    return id;
 }
 
-byte Buffer::getAckCount()
+void Buffer::setSequence(PacketId sequence)
 {
-    if (hasAck()) return mData[mSize-1];
-    return 0;
+    memcpy(&mData[PacketSequencePosition], &sequence, sizeof(sequence));
+}
+
+PacketId Buffer::getSequence() const
+{
+    PacketId sequence;
+    memcpy(&sequence, &mData[PacketSequencePosition], sizeof(sequence));
+    return sequence;
+}
+
+void Buffer::setAck(PacketId ack, AckBits bits)
+{
+    mData[PacketTypePosition] |= PF_HAS_ACK;
+    memcpy(&mData[PacketAckPosition], &ack, sizeof(ack));
+    memcpy(&mData[PacketAckBitsPosition], &bits, sizeof(bits));
 }
 
 bool Buffer::hasAck()
@@ -91,19 +118,80 @@ bool Buffer::hasAck()
     return mData[PacketTypePosition] & PF_HAS_ACK;
 }
 
-PacketId Buffer::getAck(byte i)
+PacketId Buffer::getAck() const
 {
-    return *(PacketId*)&mData[mSize-1 - getAckCount()*sizeof(PacketId) + i*sizeof(PacketId)];
+    PacketId ack;
+    memcpy(&ack, &mData[PacketAckPosition], sizeof(ack));
+    return ack;
+}
+
+AckBits Buffer::getAckBits() const
+{
+    AckBits bits;
+    memcpy(&bits, &mData[PacketAckBitsPosition], sizeof(bits));
+    return bits;
 }
 
 void Buffer::clear()
 {
     mData[0] = 0;
+    setId(0);
+    bHasId = false; // Until given one, 'ReplicationBaseline::sent' skips the backlog packets
+    setConnectionId(InvalidConnectionId);
+    setChannel(0);
+    setSequence(0);
     mSize = PacketHeaderSize;
+    mLimit = mData.size();
     mByteIt = PacketHeaderSize;
     mBoolByteIt = InvalidBoolByteIt;
     mBoolBitIt = 0;
-    mNumberOfAck = 0;
+    mMessageEnd = 0;
+    mPriority = DefaultPriority;
+    mPriorityAccumulator = 0;
+}
+
+void Buffer::rewind()
+{
+    mByteIt = PacketHeaderSize;
+    mBoolByteIt = InvalidBoolByteIt;
+    mBoolBitIt = 0;
+    mMessageEnd = 0;
+}
+
+bool Buffer::appendMessage(const byte* data, std::size_t size)
+{
+    if (mSize + sizeof(MessageSize) + size > mLimit) return false;
+
+    MessageSize s = size;
+    memcpy(&mData[mSize], &s, sizeof(s));
+    memcpy(&mData[mSize + sizeof(s)], data, size);
+    mSize += sizeof(s) + size;
+    mByteIt = mSize;
+    return true;
+}
+
+bool Buffer::nextMessage()
+{
+    if (mMessageEnd) mByteIt = mMessageEnd;
+    mBoolByteIt = InvalidBoolByteIt;
+    mBoolBitIt = 0;
+
+    if (getType() != PT_MESSAGE)
+    {
+        if (mMessageEnd) return false;
+        mByteIt = PacketHeaderSize;
+        mMessageEnd = mSize;
+        return true;
+    }
+
+    MessageSize s;
+    if (mByteIt + sizeof(s) > mSize) return false;
+    memcpy(&s, &mData[mByteIt], sizeof(s));
+    if (mByteIt + sizeof(s) + s > mSize) return false; // Truncated
+
+    mByteIt += sizeof(s);
+    mMessageEnd = mByteIt + s;
+    return true;
 }
 
 std::string byteToString(byte b)
@@ -175,7 +263,7 @@ void Buffer::write8At(const void* v, const ByteIterator& it)
 void Buffer::write16(const void* v)
 {
     UDP_NETWORK_CHECK_BUFFER_OVERFLOW(uint16_t);
-    *((Number_t*)&mData[mByteIt]) = *(const uint16_t*)v;
+    memcpy(&mData[mByteIt], v, sizeof(uint16_t));
     mByteIt += sizeof(uint16_t);
     mSize = mByteIt;
 }
@@ -184,7 +272,7 @@ Buffer::ByteIterator Buffer::write16It(const void* v)
 {
     UDP_NETWORK_CHECK_BUFFER_OVERFLOW(uint16_t);
     ByteIterator it(mByteIt);
-    *((Number_t*)&mData[mByteIt]) = *(const uint16_t*)v;
+    memcpy(&mData[mByteIt], v, sizeof(uint16_t));
     mByteIt += sizeof(uint16_t);
     mSize = mByteIt;
     return it;
@@ -193,7 +281,7 @@ Buffer::ByteIterator Buffer::write16It(const void* v)
 void Buffer::write16At(const void* v, const ByteIterator& it)
 {
     UDP_NETWORK_CHECK_BUFFER_OVERFLOW(uint16_t);
-    *((Number_t*)&mData[it.BytePosition]) = *(const uint16_t*)v;
+    memcpy(&mData[it.BytePosition], v, sizeof(uint16_t));
 }
 
 //
@@ -252,11 +340,177 @@ void Buffer::writeFloatAt(const float* v, const ByteIterator& it)
 
 void Buffer::writeString(const std::string& v)
 {
+    if (mSize + v.size() + 1 > mLimit) throw std::runtime_error("UDPNETWORK buffer overflow!");
     memcpy((char*)&mData[mByteIt], v.c_str(), v.size() + 1);
     mByteIt += v.size() + 1;
     mSize = mByteIt;
 }
 
+void Buffer::writeBytes(const void* v, std::size_t size)
+{
+    if (mSize + size > mLimit) throw std::runtime_error("UDPNETWORK buffer overflow!");
+    memcpy(&mData[mByteIt], v, size);
+    mByteIt += size;
+    mSize = mByteIt;
+}
+
+//
+
+void Buffer::writeBits(uint32_t value, unsigned bits)
+{
+    while (bits)
+    {
+        incrementBool(true);
+        unsigned count = std::min<unsigned>(bits, 8 - mBoolBitIt);
+        mData[mBoolByteIt] |= (value & ((1u << count) - 1)) << mBoolBitIt;
+        mBoolBitIt += count;
+        value >>= count;
+        bits -= count;
+    }
+}
+
+uint32_t Buffer::readBits(unsigned bits)
+{
+    uint32_t value = 0;
+    unsigned shift = 0;
+    while (bits)
+    {
+        incrementBool();
+        unsigned count = std::min<unsigned>(bits, 8 - mBoolBitIt);
+        value |= ((mData[mBoolByteIt] >> mBoolBitIt) & ((1u << count) - 1)) << shift;
+        mBoolBitIt += count;
+        shift += count;
+        bits -= count;
+    }
+    return value;
+}
+
+void Buffer::writeVarUint(uint32_t v)
+{
+    while (v >= 0x80)
+    {
+        writeByte(byte(v) | 0x80);
+        v >>= 7;
+    }
+    writeByte(v);
+}
+
+uint32_t Buffer::readVarUint()
+{
+    uint32_t v = 0;
+    for (unsigned shift = 0; shift < 35; shift += 7)
+    {
+        byte b = readByte();
+        v |= uint32_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return v;
+}
+
+void Buffer::writeVarInt(int32_t v)
+{
+    writeVarUint((uint32_t(v) << 1) ^ uint32_t(v >> 31));
+}
+
+int32_t Buffer::readVarInt()
+{
+    uint32_t v = readVarUint();
+    return int32_t(v >> 1) ^ -int32_t(v & 1);
+}
+
+void Buffer::writeRanged(int32_t v, int32_t min, int32_t max)
+{
+    if (v < min || v > max) throw std::runtime_error("UDPNETWORK value out of range!");
+    writeBits(uint32_t(v) - uint32_t(min), bitsRequired(uint32_t(max) - uint32_t(min)));
+}
+
+int32_t Buffer::readRanged(int32_t min, int32_t max)
+{
+    uint32_t range = uint32_t(max) - uint32_t(min);
+    return min + std::min(readBits(bitsRequired(range)), range);
+}
+
+void Buffer::writeQuantized(float v, float min, float max, float precision)
+{
+    uint32_t steps = std::ceil((max - min) / precision);
+    v = std::max(min, std::min(max, v));
+    writeBits(std::min<uint32_t>(std::lround((v - min) / precision), steps), bitsRequired(steps));
+}
+
+float Buffer::readQuantized(float min, float max, float precision)
+{
+    uint32_t steps = std::ceil((max - min) / precision);
+    return std::min(max, min + readBits(bitsRequired(steps)) * precision);
+}
+
+namespace
+{
+    // The three smallest components of a unit quaternion are within that
+    const float QuaternionRange = 0.707107f; // 1 / sqrt(2)
+
+    // Bits per component, the same on both sides
+    unsigned getQuaternionBits(unsigned bits)
+    {
+        return std::max(2u, std::min(31u, bits)); // (1 << 32) - 1 would overflow
+    }
+}
+
+void Buffer::writeQuaternion(float x, float y, float z, float w, unsigned bits/* = 10*/)
+{
+    float q[4] = {x, y, z, w};
+    unsigned largest = 0;
+    for (unsigned i = 1; i < 4; i++)
+    {
+        if (std::fabs(q[i]) > std::fabs(q[largest])) largest = i;
+    }
+
+    // q and -q are the same rotation, the dropped component is positive
+    float sign = q[largest] < 0 ? -1.f : 1.f;
+    bits = getQuaternionBits(bits);
+    uint32_t max = (1u << bits) - 1;
+
+    writeBits(largest, 2);
+    for (unsigned i = 0; i < 4; i++)
+    {
+        if (i == largest) continue;
+        float v = std::max(-QuaternionRange, std::min(QuaternionRange, q[i] * sign));
+        writeBits(std::lround((v + QuaternionRange) / (2 * QuaternionRange) * max), bits);
+    }
+}
+
+void Buffer::readQuaternion(float& x, float& y, float& z, float& w, unsigned bits/* = 10*/)
+{
+    float q[4];
+    bits = getQuaternionBits(bits);
+    uint32_t max = (1u << bits) - 1;
+    unsigned largest = readBits(2);
+
+    float sum = 0;
+    for (unsigned i = 0; i < 4; i++)
+    {
+        if (i == largest) continue;
+        q[i] = float(readBits(bits)) / max * 2 * QuaternionRange - QuaternionRange;
+        sum += q[i] * q[i];
+    }
+    q[largest] = std::sqrt(std::max(0.f, 1 - sum));
+
+    x = q[0];
+    y = q[1];
+    z = q[2];
+    w = q[3];
+}
+
+unsigned Buffer::bitsRequired(uint32_t range)
+{
+    unsigned bits = 0;
+    while (range)
+    {
+        ++bits;
+        range >>= 1;
+    }
+    return bits;
+}
+
 void Buffer::readBool(bool* v)
 {
     incrementBool();
@@ -270,7 +524,7 @@ void Buffer::read8(void* v)
 
 void Buffer::read16(void* v)
 {
-    *(uint16_t*)v = mData[mByteIt];
+    memcpy(v, &mData[mByteIt], sizeof(uint16_t));
     mByteIt += sizeof(uint16_t);
 }
 
@@ -292,6 +546,13 @@ void Buffer::readString(std::string& v)
     mByteIt += v.size() + 1;
 }
 
+void Buffer::readBytes(void* v, std::size_t size)
+{
+    if (mByteIt + size > mSize) throw std::runtime_error("UDPNETWORK buffer underflow!");
+    memcpy(v, &mData[mByteIt], size);
+    mByteIt += size;
+}
+
 void Buffer::peek8(void* v)
 {
     *(uint8_t*)v = mData[mByteIt];
@@ -299,7 +560,7 @@ void Buffer::peek8(void* v)
 
 void Buffer::peek16(void* v)
 {
-    *(uint16_t*)v = mData[mByteIt];
+    memcpy(v, &mData[mByteIt], sizeof(uint16_t));
 }
 
 void Buffer::peek32(void* v)
@@ -321,23 +582,17 @@ void Buffer::incrementBool(bool write/* = false*/)
 {
     if (mBoolByteIt == InvalidBoolByteIt || mBoolBitIt >= 8)
     {
+        if (write) UDP_NETWORK_CHECK_BUFFER_OVERFLOW(uint8_t);
         mBoolBitIt = 0;
         mBoolByteIt = mByteIt++;
-        mSize = mByteIt;
-        if (write) mData[mBoolByteIt] = 0;
-    }
-}
+        if (!write) return;
 
-void Buffer::finalize()
-{
-    if (mNumberOfAck)
-    {
-        mData[PacketTypePosition] |= PF_HAS_ACK;
-        write8(&mNumberOfAck);
+        mSize = mByteIt;
+        mData[mBoolByteIt] = 0;
     }
 }
 
 bool Buffer::eof()
 {
-    return mByteIt >= mSize-1 - 1 - getAckCount()*sizeof(PacketId);
+    return mByteIt >= (mMessageEnd ? mMessageEnd : mSize);
 }
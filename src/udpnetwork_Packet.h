@@ -3,9 +3,10 @@
 #include "udpnetwork_Common.h"
 
 #include <boost/asio/ip/basic_endpoint.hpp>
-#include <boost/array.hpp>
+#include <algorithm>
 #include <deque>
 #include <string>
+#include <vector>
 #include <stdint.h>
 
 namespace udp_network
@@ -19,6 +20,10 @@ enum PacketTypes
     PT_PONG,
     PT_CONNECTION,
     PT_DATA,
+    PT_ACK,     // Only the ack header, nothing to deliver
+    PT_MESSAGE, // Length prefixed messages
+    PT_FRAGMENT,// Part of a message larger than a packet, always reliable
+    PT_MTU_PROBE,// Padded path MTU probe, and its reply
 };
 
 enum PacketFlag
@@ -35,24 +40,50 @@ enum ConnectionMessage
     CM_REQUEST,
     CM_ACCEPT,
     CM_REFUSE,
-    CM_DISCONNECT
+    CM_DISCONNECT,
+    CM_CHALLENGE,         // Sent to a new address of the peer before migrating
+    CM_CHALLENGE_RESPONSE // Proves the secret of the handshake, from that address
 };
 
 typedef byte PacketType;
 typedef uint16_t PacketId;
+typedef uint32_t ConnectionId; // Random tag (16 high bits) and slot index (16 low bits, with the shard)
+typedef uint32_t AckBits;      // Bit i: reliable packet 'ack + 2 + i' received
 typedef int32_t Number_t;
+typedef uint16_t MessageSize;
+typedef uint32_t Priority;     // Send weight, local (not sent)
 
+const ConnectionId InvalidConnectionId = 0;
+const Priority DefaultPriority = 1;
+
+// Header: type and flags, packet id, connection id of the receiver,
+// last reliable id received in order and the following ones received (PF_HAS_ACK),
+// channel and sequence in the channel
 const unsigned PacketTypePosition = 0;
 const unsigned PacketIdPosition = PacketTypePosition + sizeof(PacketType);
-const unsigned PacketHeaderSize = PacketIdPosition + sizeof(PacketId);
+const unsigned PacketConnectionIdPosition = PacketIdPosition + sizeof(PacketId);
+const unsigned PacketAckPosition = PacketConnectionIdPosition + sizeof(ConnectionId);
+const unsigned PacketAckBitsPosition = PacketAckPosition + sizeof(PacketId);
+const unsigned PacketChannelPosition = PacketAckBitsPosition + sizeof(AckBits);
+const unsigned PacketSequencePosition = PacketChannelPosition + sizeof(byte);
+const unsigned PacketHeaderSize = PacketSequencePosition + sizeof(PacketId);
 const unsigned PacketFlagCount = 5;
 
+// After the header of a PT_FRAGMENT: message size and fragment offset
+const unsigned FragmentHeaderSize = 2 * sizeof(uint32_t);
+
 class Buffer
 {
 public:
+    // Datagram sizes: 'Size' is used until a larger path MTU is confirmed, up to
+    // 'MaxSize' (Ethernet MTU less the IPv4 and UDP headers). The small buffers
+    // only hold a header, for the control packets.
     static const std::size_t Size = 1024;
-    typedef boost::array<byte, Size> Data;
-    static const unsigned short InvalidBoolByteIt = -1;
+    static const std::size_t MaxSize = 1472;
+    static const std::size_t SmallSize = 64;
+    typedef std::vector<byte> Data;
+    static const unsigned InvalidBoolByteIt = -1;
+    static const std::size_t MaxMessageSize = Size - PacketHeaderSize - sizeof(MessageSize); // At 'Size'
 
     struct BoolIterator
     {
@@ -69,9 +100,19 @@ public:
         unsigned BytePosition;
     };
 
-    Buffer() { clear(); }
+    // Larger capacities hold the reassembled messages
+    Buffer(std::size_t capacity = MaxSize) : mData(capacity) { clear(); }
+
+    bool eof(); // End of the current message when reading messages
 
-    bool eof();
+    // Append a length prefixed message (PT_MESSAGE), return false if it does not fit
+    bool appendMessage(const byte* data, std::size_t size);
+
+    // Move to the next message of a PT_MESSAGE packet, read in place: 'eof'
+    // is true at its end, the unread part is skipped by the next call.
+    // Other packets are a single message. Return false when there is no message left.
+    bool nextMessage();
+    void rewind(); // Back to the first byte after the header
 
     void eraseLastByte();
     void eraseLastShort();
@@ -111,6 +152,26 @@ public:
     inline void writeIntAt(const int val, const ByteIterator& it) { write32At(&val,it); }
     inline void writeFloatAt(const float val, const ByteIterator& it) { writeFloatAt(&val,it); }
 
+    // Bit packed values, in the same bytes as the bools: read them back in the
+    // same order. The byte aligned values written in between go after the
+    // current bit byte, as with the bools.
+    void writeBits(uint32_t value, unsigned bits);
+    uint32_t readBits(unsigned bits);
+    void writeVarUint(uint32_t v); // 7 bits per byte, below 128 in 1 byte
+    uint32_t readVarUint();
+    void writeVarInt(int32_t v);   // Zigzag encoded, small negative values are small too
+    int32_t readVarInt();
+    void writeRanged(int32_t v, int32_t min, int32_t max); // In 'bitsRequired(max - min)' bits
+    int32_t readRanged(int32_t min, int32_t max);
+    void writeQuantized(float v, float min, float max, float precision); // Clamped to [min, max]
+    float readQuantized(float min, float max, float precision);
+    // Unit quaternion, smallest three: the largest component is dropped (its
+    // index in 2 bits), the others take 'bits' each, clamped to 2..31
+    void writeQuaternion(float x, float y, float z, float w, unsigned bits = 10);
+    void readQuaternion(float& x, float& y, float& z, float& w, unsigned bits = 10);
+
+    static unsigned bitsRequired(uint32_t range); // To hold 0 to 'range'
+
     // Containers
     template <class T>
     Buffer& operator << (const std::vector<T> v)
@@ -199,6 +260,7 @@ public:
     void writeFloatAt(const float* v, const ByteIterator& it);
 
     void writeString(const std::string& v);
+    void writeBytes(const void* v, std::size_t size); // Raw
 
     void peek8(void* v);
     void peek16(void* v);
@@ -212,63 +274,81 @@ public:
     void read32(void* v);
     void readFloat(float* v);
     void readString(std::string& v);
+    void readBytes(void* v, std::size_t size);
 
     Data& data() { return mData; }
     std::size_t size() { return mSize; }
+    std::size_t capacity() { return mData.size(); }
+
+    // Largest size written before the overflow error, the capacity by default
+    void setLimit(std::size_t limit) { mLimit = std::min(limit, mData.size()); }
+    std::size_t getLimit() { return mLimit; }
 
     void data(const Data& d) { mData = d; }
     void size(std::size_t s) { mSize = s; }
     
     std::size_t getHeaderSize();
-    void addAck(PacketId);
+    void setAck(PacketId ack, AckBits bits);
     bool hasAck();
-    byte getAckCount();
-    PacketId getAck(byte);
+    PacketId getAck() const;
+    AckBits getAckBits() const;
     bool getReliable() const;
     void setReliable(bool);
     byte getType() const;
     void setType(byte);
     PacketId getId() const;
     void setId(PacketId);
+    bool hasId() const { return bHasId; } // Sent packets: false while in the reliable backlog, any id is valid
+    ConnectionId getConnectionId() const;
+    void setConnectionId(ConnectionId);
+    byte getChannel() const { return mData[PacketChannelPosition]; }
+    void setChannel(byte channel) { mData[PacketChannelPosition] = channel; }
+    PacketId getSequence() const;
+    void setSequence(PacketId);
+
+    // Highest priority of the messages written. The send scheduler raises it by
+    // that much each time the packet is deferred, so it is eventually sent.
+    void raisePriority(Priority p) { mPriority = std::max(mPriority, p); }
+    Priority getPriority() const { return mPriority + mPriorityAccumulator; }
+    void accumulatePriority() { mPriorityAccumulator += mPriority; }
 
     std::string debugHeader();
     void clear();
-    void finalize();
 
 protected:
     void incrementBool(bool write = false);
 
     Data mData;
-    unsigned short mSize;
-    unsigned short mByteIt;
-    unsigned short mBoolByteIt;
+    unsigned mSize;
+    unsigned mLimit;
+    unsigned mByteIt;
+    unsigned mBoolByteIt;
     unsigned short mBoolBitIt;
-    unsigned char mNumberOfAck; 
-};
-
-struct Packet
-{
-    Buffer buffer;
-};
-
-struct UnreliablePacket : public Packet
-{
+    unsigned mMessageEnd; // 0 if not reading messages
+    Priority mPriority;
+    Priority mPriorityAccumulator;
+    bool bHasId; // Local, not sent
 };
 
-struct ReliablePacket : public Packet
+// Kept until acked, the buffer comes from the network pool
+struct ReliablePacket
 {
     ReliablePacket()
-    : wasSent(false), time(0) {}
+    : buffer(nullptr), wasSent(false), resendCount(0), time(0) {}
 
+    Buffer* buffer;
     bool wasSent;
-    unsigned time;
+    byte resendCount;
+    unsigned time; // Last sent
 };
 
-struct AddressedPacket : public UnreliablePacket
+// The buffer comes from the network pool
+struct AddressedPacket
 {
-    AddressedPacket(const boost::asio::ip::udp::endpoint& endpoint)
-    :   endpoint(endpoint) {}
+    AddressedPacket(Buffer* buffer, const boost::asio::ip::udp::endpoint& endpoint)
+    :   buffer(buffer), endpoint(endpoint) {}
 
+    Buffer* buffer;
     boost::asio::ip::udp::endpoint endpoint;
 };
 
@@ -0,0 +1,107 @@
+#include "udpnetwork_ShardedNetwork.h"
+#include "udpnetwork_Connection.h"
+#include "udpnetwork_Log.h"
+
+#include <sstream>
+
+using namespace udp_network;
+
+ShardedNetwork::ShardedNetwork(
+    const Network::ConnectionRequestCb& connect,
+    const Network::DisconnectionCb& disconnect,
+    const Network::MessageCb& message,
+    unsigned short port,
+    unsigned shardCount/* = 0*/,
+    unsigned tickRate/* = 10*/)
+
+:   mStartTime(std::chrono::steady_clock::now()),
+    mTickRate(tickRate),
+    bRunning(false),
+    bSteered(true)
+{
+    if (!shardCount) shardCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for (unsigned i = 0; i < shardCount; i++)
+    {
+        auto shard = new Shard;
+        shard->network = new Network(connect, disconnect, getTime(), port, true);
+        shard->network->setMessageCallback(message);
+        mShards.push_back(shard);
+
+        // Bind the other shards on the port chosen by the system
+        if (!port) port = shard->network->getLocalEndpoint().port();
+    }
+
+    // Once all bound, the sockets are indexed in the bind order
+    for (unsigned i = 0; i < shardCount; i++)
+    {
+        if (!mShards[i]->network->setShard(i, shardCount)) bSteered = false;
+    }
+    if (!bSteered) UDP_NETWORK_LOG_ERROR("No reuseport steering, the connections can't change address");
+}
+
+ShardedNetwork::~ShardedNetwork()
+{
+    stop();
+    for (auto shard : mShards)
+    {
+        delete shard->network;
+        delete shard;
+    }
+}
+
+void ShardedNetwork::start()
+{
+    if (bRunning) return;
+    bRunning = true;
+
+    for (auto shard : mShards)
+        shard->thread = std::thread(&ShardedNetwork::run, this, shard);
+}
+
+void ShardedNetwork::stop()
+{
+    if (!bRunning) return;
+    bRunning = false;
+
+    for (auto shard : mShards)
+    {
+        shard->network->stop();
+        shard->thread.join();
+    }
+}
+
+void ShardedNetwork::post(Connection* c, const std::function<void()>& job)
+{
+    for (unsigned i = 0; i < mShards.size(); i++)
+    {
+        if (mShards[i]->network == c->getNetwork())
+        {
+            post(i, job);
+            return;
+        }
+    }
+}
+
+void ShardedNetwork::post(unsigned shard, const std::function<void()>& job)
+{
+    mShards[shard]->network->post(job);
+}
+
+void ShardedNetwork::run(Shard* shard)
+{
+    shard->network->run(std::bind(&ShardedNetwork::getTime, this), mTickRate);
+}
+
+unsigned long ShardedNetwork::getTime()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - mStartTime).count();
+}
+
+std::string ShardedNetwork::getStatus()
+{
+    std::stringstream ss;
+    ss << mShards.size() << " shards, " << mShards.front()->network->getStatus();
+    return ss.str();
+}
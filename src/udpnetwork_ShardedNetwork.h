@@ -0,0 +1,70 @@
+#pragma once
+
+#include "udpnetwork_Network.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace udp_network
+{
+
+// Run one Network per worker thread, all bound to the same port with SO_REUSEPORT.
+//
+// The kernel routes the datagrams of a connection to the shard that accepted it
+// by their connection id (a reuseport BPF program, Linux), by their remote
+// endpoint before the handshake. So each connection lives on a single shard,
+// also after migrating to a new address, and is only touched by its thread.
+// Without the BPF steering ('isSteered' false) the datagrams are routed by
+// their endpoint only, and a connection changing address is lost. The callbacks are called from the shard threads: they can be called
+// concurrently and must synchronize any state shared between connections.
+// A connection must only be used from its shard thread, use 'post' to run code there.
+// The shards run the event driven mode of the network (see 'Network::run').
+class ShardedNetwork
+{
+public:
+    ShardedNetwork(
+        const Network::ConnectionRequestCb& connect,
+        const Network::DisconnectionCb& disconnect,
+        const Network::MessageCb& message,
+        unsigned short port,
+        unsigned shardCount = 0, // 0: one shard per core
+        unsigned tickRate = 10); // Milliseconds between timeout/resend checks
+    ~ShardedNetwork();
+
+    // The shards are configured (batch size, ...) before 'start'
+    void start();
+    void stop();
+    bool isRunning() { return bRunning; }
+    bool isSteered() { return bSteered; }
+
+    // Run 'job' on the thread of the shard owning the connection
+    void post(Connection* connection, const std::function<void()>& job);
+    void post(unsigned shard, const std::function<void()>& job);
+
+    // NOTE: a shard network must only be used from its thread once started
+    Network& getShard(unsigned shard) { return *mShards[shard]->network; }
+    unsigned getShardCount() { return mShards.size(); }
+
+    std::string getStatus();
+
+protected:
+    struct Shard
+    {
+        Network* network;
+        std::thread thread;
+    };
+
+    void run(Shard* shard);
+    unsigned long getTime();
+
+    std::vector<Shard*> mShards;
+    std::chrono::steady_clock::time_point mStartTime;
+    unsigned mTickRate;
+    std::atomic<bool> bRunning;
+    bool bSteered;
+};
+
+} // udp_network
@@ -0,0 +1,499 @@
+#include "udpnetwork_Socket.h"
+#include "udpnetwork_IoUring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <time.h>
+#endif
+
+using namespace udp_network;
+
+#ifdef __linux__
+namespace
+{
+
+// Kernel limits of a GSO message
+const std::size_t MaxSegments = 64;
+const std::size_t MaxGsoSize = 65000;
+
+// UDP_SEGMENT and SCM_TXTIME
+const std::size_t ControlSize = CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t));
+const std::size_t ControlSize64 = (ControlSize + 7) / 8;
+
+} // anonymous namespace
+#endif
+
+Socket::Socket(boost::asio::io_service& ioService, const boost::asio::ip::udp::endpoint& endpoint, bool reusePort/* = false*/)
+:   mSocket(ioService, endpoint.protocol()),
+    mBatchSize(1),
+    mIoUring(nullptr),
+    mIoUringDescriptor(ioService),
+    bGso(false),
+    bGro(false),
+    bTxTime(false)
+{
+    if (reusePort)
+    {
+#ifdef SO_REUSEPORT
+        typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+        mSocket.set_option(reuse_port(true));
+#else
+        throw std::runtime_error("UDPNETWORK SO_REUSEPORT is not supported on this platform!");
+#endif
+    }
+
+    mSocket.bind(endpoint);
+    mSocket.non_blocking(true);
+    setBatchSize(mBatchSize);
+}
+
+Socket::~Socket()
+{
+    setIoUring(false);
+}
+
+bool Socket::setIoUring(bool enable, unsigned receiveDepth/* = 256*/)
+{
+    flush();
+
+    if (mIoUring)
+    {
+        mIoUringDescriptor.release();
+        delete mIoUring;
+        mIoUring = nullptr;
+    }
+
+    if (!enable) return true;
+
+    mIoUring = new IoUring();
+    if (!mIoUring->init(mSocket.native_handle(), std::max(receiveDepth, 1u)))
+    {
+        // Not supported, fall back to the asio socket
+        delete mIoUring;
+        mIoUring = nullptr;
+        return false;
+    }
+
+    mIoUringDescriptor.assign(mIoUring->getFd());
+
+#ifdef __linux__
+    // The posted buffers can't hold coalesced datagrams
+    if (bGro) setGro(false);
+#endif
+    return true;
+}
+
+bool Socket::setSegmentationOffload(bool enable)
+{
+    flush();
+
+#ifdef UDP_SEGMENT
+    if (!enable)
+    {
+        bGso = false;
+        if (bGro) setGro(false);
+        return true;
+    }
+
+    // Probe the kernel support, a socket wide segment size of 0 is a no-op
+    int size = 0;
+    if (setsockopt(mSocket.native_handle(), SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) < 0) return false;
+    bGso = true;
+
+    if (!mIoUring) setGro(true);
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+bool Socket::setTxTime(bool enable)
+{
+    flush();
+
+#ifdef SO_TXTIME
+    // The option can't be turned off, without the control message the datagrams go out now
+    if (!enable)
+    {
+        bTxTime = false;
+        return true;
+    }
+
+    sock_txtime config;
+    config.clockid = CLOCK_MONOTONIC;
+    config.flags = 0;
+    if (setsockopt(mSocket.native_handle(), SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) < 0) return false;
+    bTxTime = true;
+    return true;
+#else
+    return !enable;
+#endif
+}
+
+bool Socket::setMtuDiscovery(bool enable)
+{
+#if defined(IP_PMTUDISC_PROBE) && defined(IPV6_PMTUDISC_PROBE)
+    int result;
+    if (mSocket.local_endpoint().address().is_v6())
+    {
+        int value = enable ? IPV6_PMTUDISC_PROBE : IPV6_PMTUDISC_WANT;
+        result = setsockopt(mSocket.native_handle(), IPPROTO_IPV6, IPV6_MTU_DISCOVER, &value, sizeof(value));
+    }
+    else
+    {
+        int value = enable ? IP_PMTUDISC_PROBE : IP_PMTUDISC_WANT;
+        result = setsockopt(mSocket.native_handle(), IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value));
+    }
+    return result == 0 || !enable;
+#else
+    return !enable;
+#endif
+}
+
+bool Socket::setShardSteering(unsigned count)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(__BYTE_ORDER__)
+    // Run on the UDP payload, the returned index is the socket in the bind order.
+    // An index out of range (no id) falls back to the hash, a datagram too short
+    // for an id goes to the first socket.
+    const unsigned id = PacketConnectionIdPosition;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const unsigned slot = id;     // Low 16 bits of the id, written in host order
+#else
+    const unsigned slot = id + 2;
+#endif
+    sock_filter code[] =
+    {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, id),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, InvalidConnectionId, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, slot + 1),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 8),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, slot),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_X, 0),
+#else
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, slot),
+#endif
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, count),
+        BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    sock_fprog program;
+    program.len = sizeof(code) / sizeof(code[0]);
+    program.filter = code;
+    return count && setsockopt(mSocket.native_handle(), SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0;
+#else
+    return false;
+#endif
+}
+
+#ifdef __linux__
+bool Socket::setGro(bool enable)
+{
+#ifdef UDP_GRO
+    int value = enable;
+    if (setsockopt(mSocket.native_handle(), SOL_UDP, UDP_GRO, &value, sizeof(value)) < 0) return false;
+    bGro = enable;
+
+    if (enable && mCoalescedData.empty())
+    {
+        mCoalescedData.resize(0x10000);
+        mCoalescedSize = 0;
+        mCoalescedOffset = 0;
+        mCoalescedSegment = 0;
+    }
+    return true;
+#else
+    return !enable;
+#endif
+}
+#endif
+
+void Socket::asyncWaitReadable(const std::function<void(const boost::system::error_code&)>& handler)
+{
+    if (mIoUring) mIoUringDescriptor.async_wait(boost::asio::posix::stream_descriptor::wait_read, handler);
+    else mSocket.async_wait(boost::asio::ip::udp::socket::wait_read, handler);
+}
+
+void Socket::setBatchSize(unsigned size)
+{
+    flush();
+    mBatchSize = std::max(size, 1u);
+
+#ifdef __linux__
+    mMessages.resize(mBatchSize);
+    mIovecs.resize(mBatchSize);
+    mMessageSegments.resize(mBatchSize);
+    mControls.resize(mBatchSize * ControlSize64);
+#endif
+}
+
+void Socket::send(Buffer& buffer, const boost::asio::ip::udp::endpoint& endpoint, unsigned delay/* = 0*/)
+{
+    if (mBatchSize <= 1 && !mIoUring && !bGso && !bTxTime)
+    {
+        boost::system::error_code errorCode;
+        mSocket.send_to(
+            boost::asio::buffer(buffer.data(), buffer.size()),
+            endpoint, 0, errorCode);
+        return;
+    }
+
+    mOutgoingDatagrams.emplace_back(buffer.data().data(), buffer.size(), endpoint, delay);
+}
+
+void Socket::flush()
+{
+    if (mOutgoingDatagrams.empty()) return;
+
+    if (mIoUring)
+    {
+        mIoUring->send(&mOutgoingDatagrams[0], mOutgoingDatagrams.size());
+        mOutgoingDatagrams.clear();
+        return;
+    }
+
+#ifdef __linux__
+    if (mIovecs.size() < mOutgoingDatagrams.size()) mIovecs.resize(mOutgoingDatagrams.size());
+
+    uint64_t now = 0;
+    if (bTxTime)
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        now = uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    std::size_t sent = 0;
+    while (sent < mOutgoingDatagrams.size())
+    {
+        // Build up to 'batch size' messages, with GSO a message carry several datagrams
+        std::size_t count = 0;
+        std::size_t next = sent;
+        for (; count < mBatchSize && next < mOutgoingDatagrams.size(); count++)
+        {
+            std::size_t segments = bGso ? getSegmentCount(next) : 1;
+
+            msghdr& h = mMessages[count].msg_hdr;
+            std::memset(&h, 0, sizeof(h));
+            h.msg_name = mOutgoingDatagrams[next].endpoint.data();
+            h.msg_namelen = mOutgoingDatagrams[next].endpoint.size();
+            h.msg_iov = &mIovecs[next];
+            h.msg_iovlen = segments;
+
+            for (std::size_t i = next; i < next + segments; i++)
+            {
+                mIovecs[i].iov_base = const_cast<byte*>(mOutgoingDatagrams[i].data);
+                mIovecs[i].iov_len = mOutgoingDatagrams[i].size;
+            }
+
+            h.msg_control = &mControls[count * ControlSize64];
+            h.msg_controllen = ControlSize;
+            std::size_t controlSize = 0;
+            cmsghdr* cm = CMSG_FIRSTHDR(&h);
+
+#ifdef UDP_SEGMENT
+            if (segments > 1)
+            {
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t segmentSize = mOutgoingDatagrams[next].size;
+                std::memcpy(CMSG_DATA(cm), &segmentSize, sizeof(segmentSize));
+                controlSize += CMSG_SPACE(sizeof(uint16_t));
+                cm = CMSG_NXTHDR(&h, cm);
+            }
+#endif
+#ifdef SO_TXTIME
+            if (bTxTime && mOutgoingDatagrams[next].delay)
+            {
+                cm->cmsg_level = SOL_SOCKET;
+                cm->cmsg_type = SCM_TXTIME;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                uint64_t txTime = now + uint64_t(mOutgoingDatagrams[next].delay) * 1000;
+                std::memcpy(CMSG_DATA(cm), &txTime, sizeof(txTime));
+                controlSize += CMSG_SPACE(sizeof(uint64_t));
+            }
+#endif
+            h.msg_controllen = controlSize;
+            if (!controlSize) h.msg_control = nullptr;
+
+            mMessageSegments[count] = segments;
+            next += segments;
+        }
+
+        int ret = ::sendmmsg(mSocket.native_handle(), &mMessages[0], count, 0);
+        if (ret <= 0)
+        {
+            if (ret < 0 && errno == EINTR) continue;
+            if (ret < 0 && bGso && errno == EIO)
+            {
+                // No checksum offload on the outgoing device, send without GSO
+                bGso = false;
+                continue;
+            }
+            // Socket buffer full or send error, the datagrams are dropped
+            // (same behaviour as 'send_to' errors).
+            break;
+        }
+
+        for (int i = 0; i < ret; i++) sent += mMessageSegments[i];
+    }
+#else
+    boost::system::error_code errorCode;
+    for (auto& d : mOutgoingDatagrams)
+    {
+        mSocket.send_to(boost::asio::buffer(d.data, d.size), d.endpoint, 0, errorCode);
+    }
+#endif
+
+    mOutgoingDatagrams.clear();
+}
+
+std::size_t Socket::receive(Buffer** buffers, boost::asio::ip::udp::endpoint* endpoints, std::size_t count)
+{
+    boost::system::error_code errorCode;
+
+    if (mIoUring) return mIoUring->receive(buffers, endpoints, count);
+
+#ifdef __linux__
+    if (bGro) return receiveCoalesced(buffers, endpoints, count);
+
+    if (mBatchSize > 1 && count > 1)
+    {
+        count = std::min<std::size_t>(count, mBatchSize);
+        for (std::size_t i = 0; i < count; i++)
+        {
+            mIovecs[i].iov_base = buffers[i]->data().data();
+            mIovecs[i].iov_len = buffers[i]->capacity();
+
+            msghdr& h = mMessages[i].msg_hdr;
+            std::memset(&h, 0, sizeof(h));
+            h.msg_name = endpoints[i].data();
+            h.msg_namelen = endpoints[i].capacity();
+            h.msg_iov = &mIovecs[i];
+            h.msg_iovlen = 1;
+        }
+
+        int ret;
+        do ret = ::recvmmsg(mSocket.native_handle(), &mMessages[0], count, MSG_DONTWAIT, 0);
+        while (ret < 0 && errno == EINTR);
+        if (ret <= 0) return 0; // Nothing was received
+
+        for (int i = 0; i < ret; i++)
+        {
+            endpoints[i].resize(mMessages[i].msg_hdr.msg_namelen);
+            buffers[i]->size(mMessages[i].msg_len);
+        }
+        return ret;
+    }
+#endif
+
+    std::size_t received = 0;
+    for (; received < count; received++)
+    {
+        buffers[received]->size(mSocket.receive_from(
+            boost::asio::buffer(buffers[received]->data(), buffers[received]->capacity()),
+            endpoints[received], 0, errorCode));
+
+        if (!buffers[received]->size()) break; // Nothing was received
+    }
+    return received;
+}
+
+#ifdef __linux__
+// Number of datagrams, starting at 'first', that can be sent in one GSO message:
+// same endpoint and every datagram but the last one of the same size.
+std::size_t Socket::getSegmentCount(std::size_t first)
+{
+    const OutgoingDatagram& d = mOutgoingDatagrams[first];
+    std::size_t total = d.size;
+    std::size_t i = first + 1;
+
+    for (; i < mOutgoingDatagrams.size() && i - first < MaxSegments; i++)
+    {
+        const OutgoingDatagram& n = mOutgoingDatagrams[i];
+        if (mOutgoingDatagrams[i - 1].size != d.size ||
+            n.size > d.size || !n.size ||
+            total + n.size > MaxGsoSize ||
+            n.endpoint != d.endpoint ||
+            n.delay != d.delay)
+        {
+            break;
+        }
+        total += n.size;
+    }
+
+    return i - first;
+}
+
+// Receive with GRO, a received datagram may hold several segments
+std::size_t Socket::receiveCoalesced(Buffer** buffers, boost::asio::ip::udp::endpoint* endpoints, std::size_t count)
+{
+    std::size_t received = 0;
+
+    while (received < count)
+    {
+        if (mCoalescedOffset >= mCoalescedSize)
+        {
+            iovec iov;
+            iov.iov_base = &mCoalescedData[0];
+            iov.iov_len = mCoalescedData.size();
+
+            uint64_t control[ControlSize64 * 2];
+            msghdr h;
+            std::memset(&h, 0, sizeof(h));
+            h.msg_name = mCoalescedEndpoint.data();
+            h.msg_namelen = mCoalescedEndpoint.capacity();
+            h.msg_iov = &iov;
+            h.msg_iovlen = 1;
+            h.msg_control = control;
+            h.msg_controllen = sizeof(control);
+
+            ssize_t ret;
+            do ret = ::recvmsg(mSocket.native_handle(), &h, MSG_DONTWAIT);
+            while (ret < 0 && errno == EINTR);
+            if (ret <= 0) break; // Nothing was received
+
+            mCoalescedEndpoint.resize(h.msg_namelen);
+            mCoalescedSize = ret;
+            mCoalescedOffset = 0;
+            mCoalescedSegment = ret;
+
+#ifdef UDP_GRO
+            for (cmsghdr* cm = CMSG_FIRSTHDR(&h); cm; cm = CMSG_NXTHDR(&h, cm))
+            {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                {
+                    int segmentSize;
+                    std::memcpy(&segmentSize, CMSG_DATA(cm), sizeof(segmentSize));
+                    if (segmentSize > 0) mCoalescedSegment = segmentSize;
+                }
+            }
+#endif
+        }
+
+        std::size_t size = std::min(mCoalescedSegment, mCoalescedSize - mCoalescedOffset);
+        if (size <= buffers[received]->capacity())
+        {
+            std::memcpy(buffers[received]->data().data(), &mCoalescedData[mCoalescedOffset], size);
+            buffers[received]->size(size);
+            endpoints[received] = mCoalescedEndpoint;
+            ++received;
+        }
+        // else: too large for a buffer, dropped
+
+        mCoalescedOffset += size;
+    }
+
+    return received;
+}
+#endif
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "udpnetwork_Common.h"
+#include "udpnetwork_Packet.h"
+
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <functional>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+namespace udp_network
+{
+
+class IoUring;
+
+struct OutgoingDatagram
+{
+    OutgoingDatagram(const byte* data, std::size_t size, const boost::asio::ip::udp::endpoint& endpoint, unsigned delay = 0)
+    :   data(data), size(size), endpoint(endpoint), delay(delay) {}
+
+    const byte* data;
+    std::size_t size;
+    boost::asio::ip::udp::endpoint endpoint;
+    unsigned delay; // Microseconds after the flush, with SO_TXTIME
+};
+
+// Wrapper around the udp socket used by the network.
+//
+// With a batch size of 1 every datagram goes through 'send_to'/'receive_from'.
+// With a larger batch size outgoing datagrams are queued until 'flush' and
+// written with sendmmsg(), and 'receive' reads up to 'batch size' datagrams
+// with a single recvmmsg() call. On platforms without those calls the batched
+// mode falls back to one syscall per datagram.
+//
+// With io_uring enabled (Linux) a multishot receive stays armed over a ring of
+// receive entries, the datagrams are copied in the caller's buffers, and
+// the queued datagrams are submitted in one io_uring_enter() on 'flush',
+// whatever the batch size.
+//
+// With segmentation offload (Linux UDP_SEGMENT/UDP_GRO) consecutive queued
+// datagrams of the same size to the same endpoint are sent as one GSO
+// message, and coalesced received datagrams are split back into buffers.
+//
+// With SO_TXTIME (Linux) the datagrams are given a transmit time and the
+// kernel queueing discipline (fq, etf) holds them until then. Without such a
+// qdisc on the outgoing device the transmit times are ignored.
+class Socket
+{
+public:
+    // With 'reusePort' several sockets can bind the same port (SO_REUSEPORT),
+    // the kernel then distribute the incoming datagrams by source address.
+    Socket(boost::asio::io_service& ioService, const boost::asio::ip::udp::endpoint& endpoint, bool reusePort = false);
+    ~Socket();
+
+    // NOTE: in batched mode the buffer must stay valid until 'flush' is called.
+    // 'delay' (microseconds) is only used with SO_TXTIME.
+    void send(Buffer& buffer, const boost::asio::ip::udp::endpoint& endpoint, unsigned delay = 0);
+    void flush();
+
+    // Receive up to 'count' datagrams, return the number of datagrams received.
+    // Received sizes are written in the buffers.
+    std::size_t receive(Buffer** buffers, boost::asio::ip::udp::endpoint* endpoints, std::size_t count);
+
+    // Call 'handler' once 'receive' has something to return
+    void asyncWaitReadable(const std::function<void(const boost::system::error_code&)>& handler);
+
+    void setBatchSize(unsigned size);
+    unsigned getBatchSize() { return mBatchSize; }
+
+    // Return false, and keep using the asio socket, if io_uring is not available.
+    // 'receiveDepth' is the number of datagrams the kernel can hold for 'receive'.
+    bool setIoUring(bool enable, unsigned receiveDepth = 256);
+    bool hasIoUring() { return mIoUring != nullptr; }
+
+    // Return false if GSO/GRO is not supported.
+    // GRO is not enabled with io_uring (the posted buffers can't hold coalesced datagrams),
+    // and io_uring sends are not segmented.
+    bool setSegmentationOffload(bool enable);
+    bool hasSegmentationOffload() { return bGso; }
+
+    // Return false if SO_TXTIME is not supported. The io_uring sends are not delayed.
+    // Disabled, the option stays set on the socket but the datagrams carry no transmit time.
+    bool setTxTime(bool enable);
+    bool hasTxTime() { return bTxTime; }
+
+    // Set the don't fragment bit and ignore the kernel path MTU estimate
+    // (IP_PMTUDISC_PROBE), for the path MTU probes of the connections.
+    // Return false if not supported.
+    bool setMtuDiscovery(bool enable);
+
+    // Sockets sharing the port (SO_REUSEPORT): pick the socket of a datagram by
+    // its connection id (slot index modulo 'count', see 'Network::setShard'),
+    // by the address hash without one. Return false if not supported.
+    bool setShardSteering(unsigned count);
+
+    bool isOpen() { return mSocket.is_open(); }
+    boost::asio::ip::udp::endpoint getLocalEndpoint() { return mSocket.local_endpoint(); }
+    boost::asio::ip::udp::socket& getSocket() { return mSocket; }
+
+protected:
+    boost::asio::ip::udp::socket mSocket;
+    unsigned mBatchSize;
+    std::vector<OutgoingDatagram> mOutgoingDatagrams;
+
+    IoUring* mIoUring;
+    boost::asio::posix::stream_descriptor mIoUringDescriptor; // Readable when completions are ready
+
+    bool bGso;
+    bool bGro;
+    bool bTxTime;
+
+#ifdef __linux__
+    std::size_t getSegmentCount(std::size_t first);
+    std::size_t receiveCoalesced(Buffer** buffers, boost::asio::ip::udp::endpoint* endpoints, std::size_t count);
+    bool setGro(bool enable);
+
+    std::vector<mmsghdr> mMessages;
+    std::vector<iovec> mIovecs;
+    std::vector<std::size_t> mMessageSegments;
+    std::vector<uint64_t> mControls; // cmsg storage, 8 bytes aligned
+
+    // Coalesced datagram being split
+    std::vector<byte> mCoalescedData;
+    std::size_t mCoalescedSize;
+    std::size_t mCoalescedOffset;
+    std::size_t mCoalescedSegment;
+    boost::asio::ip::udp::endpoint mCoalescedEndpoint;
+#endif
+};
+
+} // udp_network
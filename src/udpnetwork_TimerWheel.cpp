@@ -0,0 +1,112 @@
+#include "udpnetwork_TimerWheel.h"
+
+using namespace udp_network;
+
+TimerWheel::TimerWheel(unsigned long currentTime)
+:   mTime(currentTime),
+    mSize(0)
+{
+    for (auto& level : mSlots)
+    {
+        for (auto& head : level) head.prev = head.next = &head;
+    }
+}
+
+void TimerWheel::schedule(TimerNode* node, unsigned long expires)
+{
+    if (isScheduled(node)) cancel(node);
+
+    if (expires <= mTime) expires = mTime + 1;
+    node->expires = expires;
+    insert(node);
+    ++mSize;
+}
+
+void TimerWheel::cancel(TimerNode* node)
+{
+    if (!isScheduled(node)) return;
+    unlink(node);
+    --mSize;
+}
+
+void TimerWheel::advance(unsigned long currentTime, std::vector<TimerNode*>& expired)
+{
+    if (!mSize)
+    {
+        // Nothing to expire, jump
+        if (currentTime > mTime) mTime = currentTime;
+        return;
+    }
+
+    while (mTime < currentTime)
+    {
+        ++mTime;
+
+        // Move the timers of the upper levels down when a lower level wraps
+        unsigned level = 0;
+        unsigned long time = mTime;
+        while (level + 1 < Levels && !(time & (Slots - 1)))
+        {
+            time >>= SlotBits;
+            ++level;
+            cascade(level, time & (Slots - 1));
+        }
+
+        TimerNode* head = &mSlots[0][mTime & (Slots - 1)];
+        while (head->next != head)
+        {
+            TimerNode* node = head->next;
+            unlink(node);
+            --mSize;
+            expired.push_back(node);
+        }
+
+        if (!mSize)
+        {
+            mTime = currentTime;
+            break;
+        }
+    }
+}
+
+void TimerWheel::insert(TimerNode* node)
+{
+    unsigned long delta = node->expires - mTime;
+    if (delta >= Range)
+    {
+        delta = Range - 1;
+        node->expires = mTime + delta;
+    }
+
+    unsigned level = 0;
+    while (delta >= (1ul << (SlotBits * (level + 1)))) ++level;
+
+    unsigned slot = (node->expires >> (SlotBits * level)) & (Slots - 1);
+    link(&mSlots[level][slot], node);
+}
+
+void TimerWheel::cascade(unsigned level, unsigned slot)
+{
+    TimerNode* head = &mSlots[level][slot];
+    while (head->next != head)
+    {
+        TimerNode* node = head->next;
+        unlink(node);
+        insert(node);
+    }
+}
+
+void TimerWheel::link(TimerNode* head, TimerNode* node)
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+void TimerWheel::unlink(TimerNode* node)
+{
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
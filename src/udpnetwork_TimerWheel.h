@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+
+namespace udp_network
+{
+
+struct TimerNode
+{
+    TimerNode()
+    :   prev(nullptr), next(nullptr), expires(0), owner(nullptr) {}
+
+    TimerNode* prev;
+    TimerNode* next;
+    unsigned long expires;
+    void* owner;
+};
+
+// Hierarchical timer wheel, millisecond resolution.
+//
+// Scheduling and cancelling are O(1), advancing the time only touches the
+// expired slots (timers in the upper levels are cascaded down as the time
+// goes). Timers further than the wheel range are clamped to its range.
+class TimerWheel
+{
+public:
+    static const unsigned Levels = 4;
+    static const unsigned SlotBits = 6;
+    static const unsigned Slots = 1 << SlotBits;
+    static const unsigned long Range = 1ul << (SlotBits * Levels);
+
+    TimerWheel(unsigned long currentTime);
+
+    // Reschedule the node if already scheduled.
+    // A time in the past expires at the next 'advance'.
+    void schedule(TimerNode* node, unsigned long expires);
+    void cancel(TimerNode* node);
+    bool isScheduled(const TimerNode* node) { return node->next != nullptr; }
+
+    // Expired nodes are unscheduled and appended to 'expired'
+    void advance(unsigned long currentTime, std::vector<TimerNode*>& expired);
+
+    unsigned long getTime() { return mTime; }
+    std::size_t size() { return mSize; }
+
+protected:
+    void insert(TimerNode* node);
+    void cascade(unsigned level, unsigned slot);
+
+    static void link(TimerNode* head, TimerNode* node);
+    static void unlink(TimerNode* node);
+
+    TimerNode mSlots[Levels][Slots]; // List heads
+    unsigned long mTime;
+    std::size_t mSize;
+};
+
+} // udp_network
@@ -0,0 +1,97 @@
+#include "udpnetwork_Trace.h"
+
+#include <chrono>
+
+using namespace udp_network;
+
+TraceRing::TraceRing()
+:   mHead(0)
+{
+    for (auto& s : mSlots) s.sequence.store(0, std::memory_order_relaxed);
+}
+
+void TraceRing::record(TraceEventType type, const void* connection, uint32_t value, uint16_t extra)
+{
+    uint64_t index = mHead.fetch_add(1, std::memory_order_relaxed);
+    Slot& s = mSlots[index & (Capacity - 1)];
+
+    s.sequence.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s.event.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    s.event.connection = connection;
+    s.event.value = value;
+    s.event.extra = extra;
+    s.event.type = type;
+
+    s.sequence.store(index * 2 + 2, std::memory_order_release);
+}
+
+bool TraceRing::read(uint64_t index, TraceEvent& event)
+{
+    Slot& s = mSlots[index & (Capacity - 1)];
+
+    uint64_t sequence = s.sequence.load(std::memory_order_acquire);
+    if (sequence != index * 2 + 2) return false; // Overwritten or being written
+
+    event = s.event;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return s.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+std::size_t TraceRing::copy(TraceEvent* events, std::size_t count)
+{
+    uint64_t head = mHead.load(std::memory_order_acquire);
+    uint64_t first = head > Capacity ? head - Capacity : 0;
+    if (head - first > count) first = head - count;
+
+    std::size_t copied = 0;
+    for (uint64_t i = first; i < head; i++)
+    {
+        if (read(i, events[copied])) ++copied;
+    }
+    return copied;
+}
+
+void TraceRing::dump(std::ostream& stream)
+{
+    uint64_t head = mHead.load(std::memory_order_acquire);
+    uint64_t first = head > Capacity ? head - Capacity : 0;
+
+    TraceEvent e;
+    for (uint64_t i = first; i < head; i++)
+    {
+        if (!read(i, e)) continue;
+
+        stream << e.time << ' ' << e.connection << ' ' << traceEventToString(e.type)
+               << ' ' << e.value << ' ' << e.extra << '\n';
+    }
+}
+
+TraceRing& udp_network::getTraceRing()
+{
+    static TraceRing* ring = new TraceRing(); // Never destroyed, can be dumped at exit
+    return *ring;
+}
+
+const char* udp_network::traceEventToString(uint16_t type)
+{
+    switch (type)
+    {
+        case TE_PACKET_RECEIVED: return "packet_received";
+        case TE_PACKET_SENT: return "packet_sent";
+        case TE_PACKET_RESENT: return "packet_resent";
+        case TE_PACKET_EARLY: return "packet_early";
+        case TE_PACKET_DUPLICATED: return "packet_duplicated";
+        case TE_PACKET_DELIVERED: return "packet_delivered";
+        case TE_ACK_RECEIVED: return "ack_received";
+        case TE_PING: return "ping";
+        case TE_PONG: return "pong";
+        case TE_CONNECTION_CREATED: return "connection_created";
+        case TE_CONNECTION_DESTROYED: return "connection_destroyed";
+        case TE_MTU_CHANGED: return "mtu_changed";
+        case TE_PACKET_DEFERRED: return "packet_deferred";
+    }
+    return "unknown";
+}
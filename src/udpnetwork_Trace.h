@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <ostream>
+#include <stdint.h>
+
+// Binary per packet trace, compiled in with UDP_NETWORK_ENABLE_TRACE.
+// Recording an event is a few stores in a lock-free ring, the ring is
+// dumped on demand with 'udp_network::getTraceRing().dump(stream)'.
+
+namespace udp_network
+{
+
+enum TraceEventType
+{
+    TE_PACKET_RECEIVED,     // value: packet type, extra: size
+    TE_PACKET_SENT,         // value: packet id, extra: size
+    TE_PACKET_RESENT,       // value: packet id, extra: size
+    TE_PACKET_EARLY,        // value: packet id, extra: number of packets held
+    TE_PACKET_DUPLICATED,   // value: packet id
+    TE_PACKET_DELIVERED,    // value: packet id, extra: channel
+    TE_ACK_RECEIVED,        // value: packet id acked
+    TE_PING,
+    TE_PONG,
+    TE_CONNECTION_CREATED,
+    TE_CONNECTION_DESTROYED,
+    TE_MTU_CHANGED,         // value: path MTU
+    TE_PACKET_DEFERRED,     // value: packet id, extra: size
+};
+
+struct TraceEvent
+{
+    uint64_t time; // Steady clock, nanoseconds
+    const void* connection;
+    uint32_t value;
+    uint16_t extra;
+    uint16_t type;
+};
+
+class TraceRing
+{
+public:
+    static const std::size_t Capacity = 1 << 16; // Power of 2
+
+    TraceRing();
+
+    // Thread safe, wait-free
+    void record(TraceEventType type, const void* connection, uint32_t value, uint16_t extra);
+
+    // Write the recorded events, oldest first.
+    // Events overwritten or being written during the dump are skipped.
+    void dump(std::ostream& stream);
+
+    // Copy the recorded events, oldest first, return the number copied
+    std::size_t copy(TraceEvent* events, std::size_t count);
+
+protected:
+    bool read(uint64_t index, TraceEvent& event);
+
+    struct Slot
+    {
+        std::atomic<uint64_t> sequence; // 2 * index + 1 while written, 2 * index + 2 when done
+        TraceEvent event;
+    };
+
+    std::atomic<uint64_t> mHead;
+    Slot mSlots[Capacity];
+};
+
+TraceRing& getTraceRing();
+const char* traceEventToString(uint16_t type);
+
+} // udp_network
+
+
+#ifdef UDP_NETWORK_ENABLE_TRACE
+#define UDP_NETWORK_TRACE(_TYPE, _CONNECTION, _VALUE, _EXTRA) \
+    udp_network::getTraceRing().record(_TYPE, _CONNECTION, _VALUE, _EXTRA)
+#else
+#define UDP_NETWORK_TRACE(_TYPE, _CONNECTION, _VALUE, _EXTRA) do {} while (0)
+#endif
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "../udpnetwork_Connection.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace udp_network
+{
+
+
+typedef uint32_t ObjectId;
+
+
+// Which replicated objects each connection receives. The objects are in a
+// spatial hash grid (cells of 'cellSize', on the x/y plane), an observer only
+// looks at the cells within its radius: the cost per tick is the objects near
+// each client, not every object for every client.
+//
+//   interest.add(id, x, y);                        // Or addGlobal, for the game state
+//   interest.addObserver(connection, 100.f);       // In the connection callback
+//   interest.setObserverPosition(connection, x, y);
+//
+//   interest.update(connection, entered, left);    // Each tick, per connection
+//   for (auto id : entered) ... // Full state
+//   for (auto id : interest.getRelevant(connection)) ... // Deltas
+//   for (auto id : left) ... // Destroy on the client
+//
+// An object stays relevant until it is farther than the leave radius, so one
+// moving along the edge does not enter and leave every tick.
+// The observers must be removed with the connection ('DisconnectionCb').
+class InterestManager
+{
+public:
+    // Called for the objects in range, and the global ones
+    typedef std::function<bool(Connection*, ObjectId)> RelevancyCb;
+
+    InterestManager(float cellSize = 64.f)
+    :   mCellSize(cellSize)
+    {
+        if (cellSize <= 0.f) throw std::runtime_error("UDPNETWORK invalid interest cell size!");
+    }
+
+    void setRelevancyCallback(const RelevancyCb& relevancy) { mRelevancyCb = relevancy; }
+
+    // Objects
+    void add(ObjectId id, float x, float y)
+    {
+        remove(id);
+        Object& o = mObjects[id];
+        o.x = x;
+        o.y = y;
+        o.cell = getCell(x, y);
+        o.bGlobal = false;
+        mCells[o.cell].push_back(id);
+    }
+
+    // Relevant everywhere, only filtered by the relevancy callback
+    void addGlobal(ObjectId id)
+    {
+        remove(id);
+        Object& o = mObjects[id];
+        o.x = o.y = 0.f;
+        o.cell = 0;
+        o.bGlobal = true;
+        mGlobals.push_back(id);
+    }
+
+    void move(ObjectId id, float x, float y)
+    {
+        auto it = mObjects.find(id);
+        if (it == mObjects.end() || it->second.bGlobal) return;
+
+        Object& o = it->second;
+        o.x = x;
+        o.y = y;
+
+        Cell cell = getCell(x, y);
+        if (cell == o.cell) return;
+        eraseFrom(mCells, o.cell, id);
+        o.cell = cell;
+        mCells[cell].push_back(id);
+    }
+
+    // Left by the observers on their next update
+    void remove(ObjectId id)
+    {
+        auto it = mObjects.find(id);
+        if (it == mObjects.end()) return;
+
+        if (it->second.bGlobal) mGlobals.erase(std::find(mGlobals.begin(), mGlobals.end(), id));
+        else eraseFrom(mCells, it->second.cell, id);
+        mObjects.erase(it);
+    }
+
+    bool contains(ObjectId id) const { return mObjects.count(id) != 0; }
+    std::size_t getObjectCount() const { return mObjects.size(); }
+
+    // Observers, one per connection. 'leaveRadius' is the radius by default
+    void addObserver(Connection* c, float radius, float leaveRadius = 0.f)
+    {
+        Observer& o = mObservers[c];
+        o.radius = radius;
+        o.leaveRadius = std::max(radius, leaveRadius);
+    }
+
+    void setObserverPosition(Connection* c, float x, float y)
+    {
+        Observer& o = getObserver(c);
+        o.x = x;
+        o.y = y;
+    }
+
+    void removeObserver(Connection* c) { mObservers.erase(c); }
+
+    // Compute the objects relevant to the connection, sorted. 'entered' and
+    // 'left' get the changes since the previous update
+    void update(Connection* c, std::vector<ObjectId>& entered, std::vector<ObjectId>& left)
+    {
+        Observer& o = getObserver(c);
+        entered.clear();
+        left.clear();
+
+        mQuery.clear();
+        for (auto id : mGlobals)
+        {
+            if (!mRelevancyCb || mRelevancyCb(c, id)) mQuery.push_back(id);
+        }
+
+        // Cells within the leave radius, the entering objects must be within the radius
+        float enter = o.radius * o.radius;
+        float leave = o.leaveRadius * o.leaveRadius;
+        int32_t minX = getCoordinate(o.x - o.leaveRadius), maxX = getCoordinate(o.x + o.leaveRadius);
+        int32_t minY = getCoordinate(o.y - o.leaveRadius), maxY = getCoordinate(o.y + o.leaveRadius);
+
+        // More cells in range than occupied (large radius), look at the occupied ones
+        if (uint64_t(maxX - minX + 1) * uint64_t(maxY - minY + 1) > mCells.size())
+        {
+            for (auto& cell : mCells) query(c, o, cell.second, enter, leave);
+        }
+        else
+        {
+            for (int32_t cy = minY; cy <= maxY; cy++)
+            {
+                for (int32_t cx = minX; cx <= maxX; cx++)
+                {
+                    auto cell = mCells.find(getCell(cx, cy));
+                    if (cell != mCells.end()) query(c, o, cell->second, enter, leave);
+                }
+            }
+        }
+
+        std::sort(mQuery.begin(), mQuery.end());
+        std::set_difference(mQuery.begin(), mQuery.end(), o.relevant.begin(), o.relevant.end(), std::back_inserter(entered));
+        std::set_difference(o.relevant.begin(), o.relevant.end(), mQuery.begin(), mQuery.end(), std::back_inserter(left));
+        o.relevant.swap(mQuery);
+    }
+
+    // From the last update, sorted
+    const std::vector<ObjectId>& getRelevant(Connection* c) { return getObserver(c).relevant; }
+
+    bool isRelevant(Connection* c, ObjectId id)
+    {
+        const std::vector<ObjectId>& relevant = getObserver(c).relevant;
+        return std::binary_search(relevant.begin(), relevant.end(), id);
+    }
+
+protected:
+    typedef uint64_t Cell;
+
+    struct Object
+    {
+        float x, y;
+        Cell cell;
+        bool bGlobal;
+    };
+
+    struct Observer
+    {
+        Observer()
+        :   x(0.f), y(0.f), radius(0.f), leaveRadius(0.f) {}
+
+        float x, y;
+        float radius, leaveRadius;
+        std::vector<ObjectId> relevant; // Sorted
+    };
+
+    Observer& getObserver(Connection* c)
+    {
+        auto it = mObservers.find(c);
+        if (it == mObservers.end()) throw std::runtime_error("UDPNETWORK unknown interest observer!");
+        return it->second;
+    }
+
+    void query(Connection* c, const Observer& o, const std::vector<ObjectId>& ids, float enter, float leave)
+    {
+        for (auto id : ids)
+        {
+            const Object& object = mObjects[id];
+            float dx = object.x - o.x, dy = object.y - o.y;
+            float d = dx * dx + dy * dy;
+            if (d > leave) continue;
+            if (d > enter && !std::binary_search(o.relevant.begin(), o.relevant.end(), id)) continue;
+            if (!mRelevancyCb || mRelevancyCb(c, id)) mQuery.push_back(id);
+        }
+    }
+
+    int32_t getCoordinate(float v) const { return int32_t(std::floor(v / mCellSize)); }
+    Cell getCell(float x, float y) const { return getCell(getCoordinate(x), getCoordinate(y)); }
+    static Cell getCell(int32_t cx, int32_t cy) { return Cell(uint32_t(cx)) << 32 | uint32_t(cy); }
+
+    // Order in a cell does not matter
+    static void eraseFrom(std::unordered_map<Cell, std::vector<ObjectId>>& cells, Cell cell, ObjectId id)
+    {
+        auto it = cells.find(cell);
+        if (it == cells.end()) return;
+
+        std::vector<ObjectId>& ids = it->second;
+        auto found = std::find(ids.begin(), ids.end(), id);
+        if (found == ids.end()) return;
+        *found = ids.back();
+        ids.pop_back();
+        if (ids.empty()) cells.erase(it);
+    }
+
+    float mCellSize;
+    RelevancyCb mRelevancyCb;
+
+    std::unordered_map<ObjectId, Object> mObjects;
+    std::unordered_map<Cell, std::vector<ObjectId>> mCells;
+    std::vector<ObjectId> mGlobals;
+    std::unordered_map<Connection*, Observer> mObservers;
+    std::vector<ObjectId> mQuery; // Reused by update
+};
+
+
+} // namespace udp_network
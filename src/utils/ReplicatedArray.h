@@ -0,0 +1,388 @@
+#pragma once
+
+#include "../udpnetwork_Packet.h"
+
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UDP_NETWORK_X86_SIMD
+#include <immintrin.h>
+#endif
+
+namespace udp_network
+{
+
+
+// Mark the elements of 'size' bytes with a byte set in 'mask', the bytes at 'offset'
+inline void markChangedBytes(uint32_t mask, std::size_t offset, std::size_t size, uint64_t* dirty)
+{
+    while (mask)
+    {
+        std::size_t element = (offset + __builtin_ctz(mask)) / size;
+        dirty[element >> 6] |= uint64_t(1) << (element & 63);
+
+        // Skip the other bytes of the element
+        std::size_t end = (element + 1) * size - offset;
+        if (end >= 32) break;
+        mask &= ~((uint32_t(1) << end) - 1);
+    }
+}
+
+#ifdef UDP_NETWORK_X86_SIMD
+__attribute__((target("avx2")))
+inline std::size_t findChangedBytesAvx2(const byte* a, const byte* b, std::size_t bytes, std::size_t size, uint64_t* dirty)
+{
+    std::size_t i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        uint32_t changed = ~uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+        if (changed) markChangedBytes(changed, i, size, dirty);
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+inline std::size_t findChangedBytesSse2(const byte* a, const byte* b, std::size_t bytes, std::size_t size, uint64_t* dirty)
+{
+    std::size_t i = 0;
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        uint32_t changed = ~uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y))) & 0xffff;
+        if (changed) markChangedBytes(changed, i, size, dirty);
+    }
+    return i;
+}
+#endif
+
+// Set the bit of each element of 'a' that differs from 'b' ('count' elements
+// of 'size' bytes). 'dirty' holds (count + 63) / 64 words, cleared here.
+// The unchanged blocks are skipped 32 bytes at a time with AVX2, 16 with
+// SSE2 (checked too, i386 may lack it), or 8 otherwise.
+inline void findChangedElements(const void* a, const void* b, std::size_t count, std::size_t size, uint64_t* dirty)
+{
+    memset(dirty, 0, (count + 63) / 64 * sizeof(uint64_t));
+
+    const byte* x = (const byte*)a;
+    const byte* y = (const byte*)b;
+    std::size_t bytes = count * size;
+    std::size_t i = 0;
+
+#ifdef UDP_NETWORK_X86_SIMD
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    static const bool sse2 = __builtin_cpu_supports("sse2");
+    if (avx2) i = findChangedBytesAvx2(x, y, bytes, size, dirty);
+    else if (sse2) i = findChangedBytesSse2(x, y, bytes, size, dirty);
+#endif
+
+    for (; i + 8 <= bytes; i += 8)
+    {
+        uint64_t u, v;
+        memcpy(&u, x + i, 8);
+        memcpy(&v, y + i, 8);
+        if (u == v) continue;
+
+        uint32_t changed = 0;
+        for (unsigned j = 0; j < 8; j++) changed |= uint32_t(x[i + j] != y[i + j]) << j;
+        markChangedBytes(changed, i, size, dirty);
+    }
+
+    for (; i < bytes; i++)
+    {
+        if (x[i] == y[i]) continue;
+        std::size_t element = i / size;
+        dirty[element >> 6] |= uint64_t(1) << (element & 63);
+    }
+}
+
+
+// State of a peer for a 'ReplicatedArray': the snapshot of each element it
+// acked, and the runs of the packets not acked yet. Kept with the connection,
+// fed from 'Network::setAckCallback' like 'ReplicationBaseline'.
+// Only the reliable packets are acked: elements sent unreliably are sent
+// again by the next encodes, until a reliable packet holding them is acked.
+class ReplicatedArrayBaseline
+{
+template <class T> friend class ReplicatedArray;
+
+public:
+    static const std::size_t MaxPending = 64; // Oldest forgotten, their elements are sent again
+
+    ReplicatedArrayBaseline()
+    :   mSnapshot(0), mNext(0) {}
+
+    // Send every element again
+    void reset()
+    {
+        std::fill(mAcked.begin(), mAcked.end(), 0);
+        mWritten.clear();
+        mPending.clear();
+        mNext = 0;
+    }
+
+    // The runs of the last encode were written in the packet 'id'
+    void sent(PacketId id)
+    {
+        if (mWritten.empty()) return;
+        if (mPending.size() == MaxPending) mPending.pop_front();
+        mPending.push_back({id, mSnapshot, mWritten});
+        mWritten.clear();
+    }
+
+    // Skipped in the backlog, the id is not known yet
+    void sent(const Buffer& packet)
+    {
+        if (packet.hasId()) sent(packet.getId());
+    }
+
+    void acked(PacketId id)
+    {
+        for (auto it = mPending.begin(); it != mPending.end(); ++it)
+        {
+            if (it->id != id) continue;
+            for (auto& run : it->runs) ack(run.first, run.second, it->snapshot);
+            mPending.erase(it);
+            return;
+        }
+    }
+
+protected:
+    typedef std::pair<std::size_t, std::size_t> Run; // First element and length
+
+    struct Packet
+    {
+        PacketId id;
+        uint32_t snapshot;
+        std::vector<Run> runs;
+    };
+
+    void ack(std::size_t first, std::size_t length, uint32_t snapshot)
+    {
+        std::size_t end = std::min(first + length, mAcked.size()); // The array may have shrunk
+        for (std::size_t i = first; i < end; i++) mAcked[i] = std::max(mAcked[i], snapshot);
+    }
+
+    std::vector<uint32_t> mAcked; // Per element
+    std::vector<Run> mWritten;    // By the last encode
+    uint32_t mSnapshot;           // Of the last encode
+    std::size_t mNext;            // The last encode did not fit, continued from there
+    std::deque<Packet> mPending;
+};
+
+
+// Large array of plain values (positions, health, ...) replicated as runs of
+// changed elements. 'commit' compares the values with the committed ones
+// (see 'findChangedElements') and gives the changed elements a new snapshot,
+// shared by every peer.
+//
+// Against a peer baseline, 'encode' writes the elements changed since the peer
+// acked them: lost or not, they are written again until acked. The runs that
+// don't fit the buffer limit go with the next encodes.
+// Without a baseline the elements are written once, for a single peer on a
+// reliable ordered channel.
+//
+// Format: array size, snapshot, run count, then per run the gap since the
+// previous run, its length and the raw elements (varints but the count).
+// 'decode' keeps the snapshot of each element and skips the older ones
+// (reordered). It refuses a size above 'setMaxSize', the peer chooses it.
+template <class T>
+class ReplicatedArray
+{
+public:
+    static_assert(std::is_trivially_copyable<T>::value, "ReplicatedArray: plain values only");
+
+    static const std::size_t DefaultMaxSize = 65536;
+
+    ReplicatedArray(std::size_t size = 0)
+    :   mMaxSize(std::max(size, DefaultMaxSize)), mSnapshot(0)
+    {
+        resize(size);
+    }
+
+    // Every element is sent again
+    void resize(std::size_t size)
+    {
+        mValues.resize(size);
+        mCommitted.resize(size);
+        mDirty.resize((size + 63) / 64);
+        mChanged.assign(size, ++mSnapshot);
+    }
+
+    std::size_t size() const { return mValues.size(); }
+
+    // Largest array size accepted from 'decode'
+    void setMaxSize(std::size_t size) { mMaxSize = size; }
+    std::size_t getMaxSize() const { return mMaxSize; }
+    T& operator[](std::size_t i) { return mValues[i]; }
+    const T& operator[](std::size_t i) const { return mValues[i]; }
+    T* data() { return mValues.data(); }
+
+    void force() { mLocal.reset(); } // Every element with the next encode without a baseline
+
+    uint32_t getSnapshot() { return mSnapshot; }
+
+    // Compare with the committed values, return the number of elements changed
+    std::size_t diff()
+    {
+        findChangedElements(mValues.data(), mCommitted.data(), size(), sizeof(T), mDirty.data());
+
+        std::size_t changed = 0;
+        for (auto w : mDirty) changed += __builtin_popcountll(w);
+        return changed;
+    }
+
+    const std::vector<uint64_t>& getDirty() { return mDirty; } // From the last 'diff'
+
+    // New snapshot if an element changed, called by the encodes
+    void commit()
+    {
+        if (!diff()) return;
+
+        ++mSnapshot;
+        for (std::size_t i = nextDirty(0); i < size(); i = nextDirty(i + 1))
+        {
+            mChanged[i] = mSnapshot;
+            mCommitted[i] = mValues[i];
+        }
+    }
+
+    // Return false if some changed elements did not fit, then 'baseline.sent'
+    // with the id of the packet
+    bool encode(Buffer& b, ReplicatedArrayBaseline& baseline)
+    {
+        commit();
+        if (baseline.mAcked.size() != size()) baseline.mAcked.resize(size(), 0);
+        baseline.mWritten.clear();
+        baseline.mSnapshot = mSnapshot;
+
+        b.writeVarUint(size());
+        b.writeVarUint(mSnapshot);
+        Buffer::ByteIterator countIt = b.writeShortIt(0);
+        uint16_t count = 0;
+
+        std::size_t previous = 0;
+        std::size_t i = nextChanged(baseline, std::min(baseline.mNext, size()));
+        while (i < size())
+        {
+            std::size_t end = i + 1;
+            while (end < size() && isChanged(baseline, end)) ++end;
+
+            // Varints of the gap and length, 5 bytes at most each
+            std::size_t room = b.getLimit() - b.size();
+            std::size_t length = room > 10 && count < 0xffff ? std::min(end - i, (room - 10) / sizeof(T)) : 0;
+            if (!length)
+            {
+                baseline.mNext = i;
+                return finish(b, countIt, count, false);
+            }
+
+            b.writeVarUint(i - previous);
+            b.writeVarUint(length);
+            b.writeBytes(&mValues[i], length * sizeof(T));
+            baseline.mWritten.push_back({i, length});
+            ++count;
+
+            previous = i + length;
+            if (length < end - i)
+            {
+                baseline.mNext = previous;
+                return finish(b, countIt, count, false);
+            }
+            i = nextChanged(baseline, end);
+        }
+
+        baseline.mNext = 0;
+        return finish(b, countIt, count, true);
+    }
+
+    // Without a baseline, the elements written are kept as received
+    bool encode(Buffer& b)
+    {
+        bool complete = encode(b, mLocal);
+        for (auto& run : mLocal.mWritten) mLocal.ack(run.first, run.second, mSnapshot);
+        mLocal.mWritten.clear();
+        return complete;
+    }
+
+    void decode(Buffer& b)
+    {
+        std::size_t s = b.readVarUint();
+        if (s > mMaxSize) throw std::runtime_error("UDPNETWORK replicated array too large!");
+        if (s != size())
+        {
+            resize(s);
+            std::fill(mChanged.begin(), mChanged.end(), 0); // Nothing received yet
+        }
+
+        uint32_t snapshot = b.readVarUint();
+        uint16_t count;
+        b >> count;
+
+        std::size_t i = 0;
+        while (count--)
+        {
+            i += b.readVarUint();
+            std::size_t length = b.readVarUint();
+            if (i + length > size() || i + length < i) throw std::runtime_error("UDPNETWORK invalid replicated array!");
+
+            for (std::size_t end = i + length; i < end; i++)
+            {
+                T value;
+                b.readBytes(&value, sizeof(T));
+                if (snapshot < mChanged[i]) continue; // Newer received
+
+                mValues[i] = value;
+                mCommitted[i] = value;
+                mChanged[i] = snapshot;
+            }
+        }
+    }
+
+protected:
+    bool isDirty(std::size_t i) { return mDirty[i >> 6] & (uint64_t(1) << (i & 63)); }
+    bool isChanged(const ReplicatedArrayBaseline& baseline, std::size_t i) { return mChanged[i] > baseline.mAcked[i]; }
+
+    std::size_t nextDirty(std::size_t i)
+    {
+        while (i < size())
+        {
+            uint64_t w = mDirty[i >> 6] >> (i & 63);
+            if (w) return i + __builtin_ctzll(w);
+            i = (i | 63) + 1; // Next word
+        }
+        return size();
+    }
+
+    std::size_t nextChanged(const ReplicatedArrayBaseline& baseline, std::size_t i)
+    {
+        while (i < size() && !isChanged(baseline, i)) ++i;
+        return i;
+    }
+
+    bool finish(Buffer& b, const Buffer::ByteIterator& countIt, uint16_t count, bool complete)
+    {
+        b.writeShortAt(count, countIt);
+        return complete;
+    }
+
+    std::vector<T> mValues;
+    std::vector<T> mCommitted;
+    std::vector<uint32_t> mChanged; // Snapshot of each element, received when decoding
+    std::vector<uint64_t> mDirty;
+    std::size_t mMaxSize;
+    uint32_t mSnapshot;
+    ReplicatedArrayBaseline mLocal; // Without a baseline
+};
+
+template <class T> const std::size_t ReplicatedArray<T>::DefaultMaxSize;
+
+
+} // namespace udp_network
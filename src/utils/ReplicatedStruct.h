@@ -0,0 +1,126 @@
+#pragma once
+
+#include "../udpnetwork_Packet.h"
+
+#include <tuple>
+#include <type_traits>
+
+namespace udp_network
+{
+
+
+// Replicated fields stored in place, for the many small objects a tick sends.
+// The encode and decode are generated per struct: no allocation per field and
+// no virtual call. The fields are written with the Buffer stream operators.
+//
+//   enum { Health, Speed, Team };
+//   typedef ReplicatedStruct<int32_t, float, uint8_t> Player;
+//
+//   player.set<Health>(100);
+//   player.encode(buffer); // Dirty mask, then the dirty fields
+//   other.decode(buffer);
+//
+// The dirty bits of every field are in one mask. 'encode(buffer, mask)'
+// writes any set of fields, for masks kept per peer.
+template <class... T>
+class ReplicatedStruct
+{
+public:
+    static const std::size_t FieldCount = sizeof...(T);
+    static_assert(FieldCount > 0 && FieldCount <= 64, "ReplicatedStruct: 1 to 64 fields");
+
+    typedef uint64_t Mask;
+    typedef std::tuple<T...> Fields;
+    template <std::size_t I> using FieldType = typename std::tuple_element<I, Fields>::type;
+
+    static const Mask AllFields = ~Mask(0) >> (64 - FieldCount);
+
+    ReplicatedStruct()
+    :   mFields(), mDirty(AllFields) {}
+
+    ReplicatedStruct(const T&... fields)
+    :   mFields(fields...), mDirty(AllFields) {}
+
+    template <std::size_t I>
+    const FieldType<I>& get() const { return std::get<I>(mFields); }
+
+    template <std::size_t I>
+    void set(const FieldType<I>& v)
+    {
+        if (v == std::get<I>(mFields)) return;
+        std::get<I>(mFields) = v;
+        mDirty |= Mask(1) << I;
+    }
+
+    Mask getDirty() const { return mDirty; }
+    bool isDirty() const { return mDirty != 0; }
+    void clearDirty() { mDirty = 0; }
+    void force() { mDirty = AllFields; }
+
+    // Write the dirty fields, and clear them
+    void encode(Buffer& b)
+    {
+        encode(b, mDirty);
+        mDirty = 0;
+    }
+
+    void encode(Buffer& b, Mask mask) const
+    {
+        writeMask(b, mask);
+        encodeFields(b, mask, std::integral_constant<std::size_t, 0>());
+    }
+
+    // Return the fields read
+    Mask decode(Buffer& b)
+    {
+        Mask mask = readMask(b);
+        decodeFields(b, mask, std::integral_constant<std::size_t, 0>());
+        return mask;
+    }
+
+protected:
+    static void writeMask(Buffer& b, Mask mask)
+    {
+        if (FieldCount > 32)
+        {
+            b.writeBits(uint32_t(mask), 32);
+            b.writeBits(uint32_t(mask >> 32), FieldCount - 32);
+        }
+        else b.writeBits(uint32_t(mask), FieldCount);
+    }
+
+    static Mask readMask(Buffer& b)
+    {
+        if (FieldCount > 32)
+        {
+            Mask low = b.readBits(32);
+            return low | Mask(b.readBits(FieldCount - 32)) << 32;
+        }
+        return b.readBits(FieldCount);
+    }
+
+    template <std::size_t I>
+    void encodeFields(Buffer& b, Mask mask, std::integral_constant<std::size_t, I>) const
+    {
+        if (mask & (Mask(1) << I)) b << std::get<I>(mFields);
+        encodeFields(b, mask, std::integral_constant<std::size_t, I + 1>());
+    }
+    void encodeFields(Buffer&, Mask, std::integral_constant<std::size_t, FieldCount>) const {}
+
+    template <std::size_t I>
+    void decodeFields(Buffer& b, Mask mask, std::integral_constant<std::size_t, I>)
+    {
+        if (mask & (Mask(1) << I)) b >> std::get<I>(mFields);
+        decodeFields(b, mask, std::integral_constant<std::size_t, I + 1>());
+    }
+    void decodeFields(Buffer&, Mask, std::integral_constant<std::size_t, FieldCount>) {}
+
+    Fields mFields; // Contiguous, in the struct
+    Mask mDirty;
+};
+
+template <class... T> const std::size_t ReplicatedStruct<T...>::FieldCount;
+template <class... T> const typename ReplicatedStruct<T...>::Mask ReplicatedStruct<T...>::AllFields;
+
+
+} // namespace udp_network
@@ -1,7 +1,9 @@
 #pragma once
 
 #include "../udpnetwork_Packet.h"
-#include <iostream>
+#include "../udpnetwork_Log.h"
+
+#include <deque>
 
 namespace udp_network
 {
@@ -17,16 +19,17 @@ friend class ReplicatedVariableContainer;
 
 protected:
     ReplicatedVariableBase()
-    :   bUpdated(true) {}
+    :   bUpdated(true), mSnapshot(0) {}
     virtual ~ReplicatedVariableBase() {}
 
     virtual void send(Buffer& stream) = 0;
-    virtual void receive(Buffer& stream) = 0;
-    
+    virtual void receive(Buffer& stream, bool apply) = 0;
+
     bool updated() { return bUpdated; }
     void force() { bUpdated = true; }
 
-    bool bUpdated;
+    bool bUpdated;      // Changed since the last snapshot
+    uint32_t mSnapshot; // Last changed in this snapshot
 };
 
 
@@ -49,21 +52,79 @@ protected:
     ReplicatedVariable(Args&&... args)
     :   ReplicatedVariableBase(), mData(std::forward<Args>(args)...) {}
 
-    void send(Buffer& stream) { /*stream << mData;*/ bUpdated = false; }
-    void receive(Buffer& stream) { /*stream >> mData;*/ }
+    void send(Buffer& stream) { stream << mData; }
+    void receive(Buffer& stream, bool apply)
+    {
+        if (apply) stream >> mData;
+        else
+        {
+            T skipped(mData); // Stale snapshot
+            stream >> skipped;
+        }
+    }
 
 private:
     T mData;
 };
 
 
+// State of a peer: the last snapshot it acked, and the snapshots sent in
+// reliable packets not acked yet. Kept with the connection, fed from
+// 'Network::setAckCallback'.
+// Only the reliable packets are acked: snapshots sent unreliably are not
+// recorded, their deltas grow from the last reliable snapshot acked.
+class ReplicationBaseline
+{
+public:
+    static const std::size_t MaxPending = 64; // Oldest forgotten, a lost ack only makes larger deltas
+
+    ReplicationBaseline()
+    :   mAcked(0) {}
+
+    uint32_t get() const { return mAcked; }
+    void reset() { mAcked = 0; mPending.clear(); } // Send every variable again
+
+    // 'snapshot' was written in the packet 'id'
+    void sent(PacketId id, uint32_t snapshot)
+    {
+        if (mPending.size() == MaxPending) mPending.pop_front();
+        mPending.push_back({id, snapshot});
+    }
+
+    // Skipped in the backlog, the id is not known yet
+    void sent(const Buffer& packet, uint32_t snapshot)
+    {
+        if (packet.hasId()) sent(packet.getId(), snapshot);
+    }
+
+    void acked(PacketId id)
+    {
+        for (auto& p : mPending)
+        {
+            if (p.first == id) mAcked = std::max(mAcked, p.second);
+        }
+
+        // The older snapshots are superseded
+        while (!mPending.empty() && mPending.front().second <= mAcked) mPending.pop_front();
+    }
+
+private:
+    uint32_t mAcked;
+    std::deque<std::pair<PacketId, uint32_t>> mPending;
+};
+
+
+// Snapshots of the variables, as deltas: only the variables changed since the
+// snapshot of the baseline are written. Against a peer baseline the delta holds
+// everything the peer may miss, a lost snapshot is covered by the next ones.
+// Without a baseline each snapshot holds the changes since the previous one.
 class ReplicatedVariableContainer
 {
 friend class ReplicatedVariableBase;
 
 public:
     ReplicatedVariableContainer()
-    :   bForce(false)
+    :   bForce(false), mSnapshot(0), mLocalBaseline(0), mReceivedSnapshot(0)
     {
     }
     ~ReplicatedVariableContainer()
@@ -80,52 +141,74 @@ public:
         return *t;
     }
 
+    // Return the snapshot written, for 'ReplicationBaseline::sent'
     template <class STREAM_T>
-    void send(STREAM_T& stream)
+    uint32_t send(STREAM_T& stream, const ReplicationBaseline& baseline)
     {
-        // Write updated variable
-        for (size_t i = 0; i < mVariables.size(); i++)
-        {
-            if (mVariables[i]->updated() || bForce) stream << true; 
-            else stream << false;
-        }
+        return writeSnapshot(stream, baseline.get());
+    }
 
-        for (size_t i = 0; i < mVariables.size(); i++)
-        {
-            if (mVariables[i]->updated() || bForce)
-            {
-                std::cout<<"replicated updated, sending: "<<i<<std::endl;
-                mVariables[i]->send(stream);
-            }
-        }
+    // The variables changed since the snapshot 'baseline', 0 for all of them
+    template <class STREAM_T>
+    uint32_t send(STREAM_T& stream, uint32_t baseline)
+    {
+        return writeSnapshot(stream, baseline);
+    }
 
-        bForce = false;
+    template <class STREAM_T>
+    void send(STREAM_T& stream)
+    {
+        mLocalBaseline = writeSnapshot(stream, mLocalBaseline);
     }
 
     template <class STREAM_T>
     void receive(STREAM_T& stream)
     {
+        uint32_t snapshot;
+        stream >> snapshot;
+
         // Read received variable
         for (size_t i = 0; i < mVariables.size(); i++)
         {
             bool b;
             stream >> b;
             mReceived[i] = b;
-            std::cout<<"readed updated: "<<i<<" " <<b<<std::endl;
         }
 
+        // Older than the last applied (reordered), read and dropped
+        bool apply = snapshot > mReceivedSnapshot;
+        if (apply) mReceivedSnapshot = snapshot;
+
         for (size_t i = 0; i < mVariables.size(); i++)
         {
             if (mReceived[i])
             {
-                std::cout<<"replicated updated, received: "<<i<<std::endl;
-                mVariables[i]->receive(stream);
+                UDP_NETWORK_LOG_DEBUG("replicated updated, received: " << i);
+                mVariables[i]->receive(stream, apply);
             }
         }
     }
 
+    // New snapshot if a variable changed, shared by every peer
+    void commit()
+    {
+        bool updated = false;
+        for (auto var : mVariables) updated |= var->updated();
+        if (!updated) return;
+
+        ++mSnapshot;
+        for (auto var : mVariables)
+        {
+            if (!var->updated()) continue;
+            var->mSnapshot = mSnapshot;
+            var->bUpdated = false;
+        }
+    }
+
     void force() { bForce = true; }
 
+    uint32_t getSnapshot() { return mSnapshot; }
+
     // Stream operator
     template <class STREAM_T>
     friend STREAM_T& operator >> (STREAM_T& stream, ReplicatedVariableContainer& c)
@@ -142,7 +225,36 @@ public:
     }
 
 protected:
+    template <class STREAM_T>
+    uint32_t writeSnapshot(STREAM_T& stream, uint32_t baseline)
+    {
+        commit();
+        stream << mSnapshot;
+
+        // Write updated variable
+        for (size_t i = 0; i < mVariables.size(); i++)
+        {
+            if (mVariables[i]->mSnapshot > baseline || bForce) stream << true;
+            else stream << false;
+        }
+
+        for (size_t i = 0; i < mVariables.size(); i++)
+        {
+            if (mVariables[i]->mSnapshot > baseline || bForce)
+            {
+                UDP_NETWORK_LOG_DEBUG("replicated updated, sending: " << i);
+                mVariables[i]->send(stream);
+            }
+        }
+
+        bForce = false;
+        return mSnapshot;
+    }
+
     bool bForce;
+    uint32_t mSnapshot;         // Last committed
+    uint32_t mLocalBaseline;    // Last sent, without a peer baseline
+    uint32_t mReceivedSnapshot; // Last applied
     std::vector<ReplicatedVariableBase*> mVariables;
     std::vector<bool> mReceived;
 };
@@ -0,0 +1,485 @@
+#pragma once
+
+#include "../udpnetwork_Connection.h"
+#include "InterestManager.h"
+#include "ReplicatedVariable.h"
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace udp_network
+{
+
+
+typedef uint32_t EntityType; // Picks the class created by the remote side
+
+enum ReplicationMode
+{
+    RM_UNRELIABLE, // Full state, unreliable: the latest wins (positions, ...)
+    RM_RELIABLE,   // Deltas since the last sent, reliable ordered
+};
+
+
+// Replicated object, the variables are added by the derived classes in the
+// same order on both sides.
+//
+//   class Player : public ReplicatedEntity
+//   {
+//   public:
+//       Player() : ReplicatedEntity(PlayerType), mHealth(add<int>(100)) {}
+//       ReplicatedVariable<int>& mHealth;
+//   };
+class ReplicatedEntity
+{
+friend class ReplicationManager;
+
+public:
+    ReplicatedEntity(EntityType type, ReplicationMode mode = RM_UNRELIABLE, Priority priority = DefaultPriority)
+    :   mId(0), mType(type), mMode(mode), mPriority(priority), mCacheSnapshot(0) {}
+    virtual ~ReplicatedEntity() {}
+
+    ReplicatedEntity(const ReplicatedEntity&) = delete;
+    ReplicatedEntity& operator = (const ReplicatedEntity&) = delete;
+
+    ObjectId getId() const { return mId; } // 0 until spawned
+    EntityType getType() const { return mType; }
+    ReplicationMode getMode() const { return mMode; }
+
+    // Added to the accumulator of each connection every tick the entity waits
+    void setPriority(Priority priority) { mPriority = std::max(priority, Priority(1)); }
+    Priority getPriority() const { return mPriority; }
+
+    ReplicatedVariableContainer& getVariables() { return mVariables; }
+
+protected:
+    template <class T, typename ...Args>
+    ReplicatedVariable<T>& add(Args&&... args)
+    {
+        return mVariables.add<T>(std::forward<Args>(args)...);
+    }
+
+    ObjectId mId;
+    EntityType mType;
+    ReplicationMode mMode;
+    Priority mPriority;
+    ReplicatedVariableContainer mVariables;
+
+    // Full state, written once per snapshot for every connection
+    std::vector<byte> mCache;
+    uint32_t mCacheSnapshot;
+};
+
+
+// Entities replicated to the connections, as messages:
+//  - spawn (type and full state) and despawn, on the reliable channel
+//  - state updates, on the unreliable channel or the reliable one (RM_RELIABLE)
+//
+// Server side, once per tick before the network update:
+//
+//   manager.addConnection(connection); // In the connection callback
+//   manager.spawn(entity);             // Id given, sent by the next update
+//   manager.update();
+//
+// Client side, with the spawn callback creating the entities by type:
+//
+//   network.setMessageCallback([&](Connection* c, Buffer& b) {
+//       if (manager.receive(c, b)) return;
+//       ...
+//   });
+//
+// Each connection has a priority accumulator per entity. The entities to spawn,
+// then the ones changed, are sent by accumulated priority until the byte budget
+// of the tick is used, the others wait with a higher priority. The unreliable
+// entities unchanged are sent again every 'setRefreshInterval' ticks, in case
+// the update was lost.
+//
+// With an interest manager the entities are spawned on a connection when
+// entering its scope and despawned when leaving it. The entities must be added
+// to it after 'spawn' (with their id), they are removed on 'despawn'.
+//
+// The ids are not reused: a late update of a despawned entity is dropped.
+// The entities are owned by the caller, delete them after 'despawn' (server)
+// or in the despawn callback (client).
+class ReplicationManager
+{
+public:
+    typedef std::function<ReplicatedEntity*(Connection*, ObjectId, EntityType)> SpawnCb;
+    typedef std::function<void(Connection*, ReplicatedEntity*)> DespawnCb;
+
+    // 'header' is the first byte of the messages, to tell them from the others.
+    // 'unreliable' should be an unreliable sequenced channel, the older updates
+    // are dropped anyway.
+    ReplicationManager(
+        byte header = 0xff,
+        ChannelId reliable = DefaultReliableChannel,
+        ChannelId unreliable = DefaultUnreliableChannel)
+    :   mHeader(header), mReliableChannel(reliable), mUnreliableChannel(unreliable),
+        mNextId(1), mTick(0), mBudget(0), mRefreshInterval(10), mInterest(nullptr),
+        mScratch(Connection::MaxFragmentedMessageSize), mState(Connection::MaxFragmentedMessageSize)
+    {
+    }
+
+    // Bytes of messages per connection per tick, 0 for no limit. The despawns
+    // go first, then the spawns and the updates. A message larger than the
+    // budget is sent alone.
+    void setBudget(unsigned bytes) { mBudget = bytes; }
+    void setRefreshInterval(unsigned ticks) { mRefreshInterval = ticks; } // 0 to never send again
+    // The observers are its caller's. Without one every entity is relevant
+    void setInterestManager(InterestManager* interest)
+    {
+        mInterest = interest;
+        for (auto& p : mPeers) p.second.bNew = true;
+    }
+
+    void setSpawnCallback(const SpawnCb& spawn) { mSpawnCb = spawn; }
+    void setDespawnCallback(const DespawnCb& despawn) { mDespawnCb = despawn; }
+
+    // Server
+    ObjectId spawn(ReplicatedEntity* entity)
+    {
+        if (entity->mId) throw std::runtime_error("UDPNETWORK entity already spawned!");
+        entity->mId = mNextId++;
+        if (!mNextId) mNextId = 1;
+
+        mEntities[entity->mId] = entity;
+        mSpawned.push_back(entity->mId);
+        return entity->mId;
+    }
+
+    void despawn(ReplicatedEntity* entity)
+    {
+        if (!mEntities.erase(entity->mId)) return;
+        if (mInterest) mInterest->remove(entity->mId);
+        mDespawned.push_back(entity->mId);
+        entity->mId = 0;
+    }
+
+    ReplicatedEntity* getEntity(ObjectId id)
+    {
+        auto it = mEntities.find(id);
+        return it == mEntities.end() ? nullptr : it->second;
+    }
+
+    std::size_t getEntityCount() { return mEntities.size(); }
+
+    void addConnection(Connection* c)
+    {
+        Peer& peer = mPeers[c];
+        peer.entities.clear();
+        peer.spawning.clear();
+        peer.despawning.clear();
+        peer.bNew = true;
+    }
+
+    // Client side the entities of the connection are despawned
+    void removeConnection(Connection* c)
+    {
+        mPeers.erase(c);
+
+        auto remote = mRemoteEntities.find(c);
+        if (remote == mRemoteEntities.end()) return;
+        for (auto& e : remote->second)
+        {
+            if (mDespawnCb) mDespawnCb(c, e.second);
+        }
+        mRemoteEntities.erase(remote);
+    }
+
+    // Write the messages of the tick
+    void update()
+    {
+        ++mTick;
+        for (auto& e : mEntities) e.second->mVariables.commit();
+
+        for (auto& p : mPeers) update(p.first, p.second);
+
+        mSpawned.clear();
+        mDespawned.clear();
+    }
+
+    // Client, return false if 'b' is not a replication message (left unread)
+    bool receive(Connection* c, Buffer& b)
+    {
+        if (b.eof() || b.peekByte() != mHeader) return false;
+
+        byte header, message;
+        b >> header >> message;
+        ObjectId id = b.readVarUint();
+        std::unordered_map<ObjectId, ReplicatedEntity*>& entities = mRemoteEntities[c];
+
+        switch (message)
+        {
+            case EM_SPAWN:
+            {
+                EntityType type = b.readVarUint();
+                removeRemote(c, entities, id); // Respawned
+
+                ReplicatedEntity* entity = mSpawnCb ? mSpawnCb(c, id, type) : nullptr;
+                if (!entity) return true; // Ignored, its updates too
+                entity->mId = id;
+                entities[id] = entity;
+                b >> entity->mVariables;
+                break;
+            }
+            case EM_DESPAWN:
+                removeRemote(c, entities, id);
+                break;
+            case EM_UPDATE:
+            {
+                auto it = entities.find(id);
+                if (it != entities.end()) b >> it->second->mVariables; // Else before the spawn, or after the despawn
+                break;
+            }
+            default:
+                throw std::runtime_error("UDPNETWORK invalid replication message!");
+        }
+
+        return true;
+    }
+
+    ReplicatedEntity* getEntity(Connection* c, ObjectId id)
+    {
+        auto remote = mRemoteEntities.find(c);
+        if (remote == mRemoteEntities.end()) return nullptr;
+        auto it = remote->second.find(id);
+        return it == remote->second.end() ? nullptr : it->second;
+    }
+
+protected:
+    enum EntityMessage
+    {
+        EM_SPAWN,
+        EM_DESPAWN,
+        EM_UPDATE,
+    };
+
+    // Entity as known by a connection
+    struct PeerEntity
+    {
+        uint32_t sent;         // Snapshot
+        Priority accumulator;
+        unsigned sentTick;
+    };
+
+    struct Peer
+    {
+        std::unordered_map<ObjectId, PeerEntity> entities; // Spawned
+        std::unordered_map<ObjectId, Priority> spawning;   // Waiting for the budget, with their accumulator
+        std::vector<ObjectId> despawning;                  // Waiting for the budget
+        bool bNew; // Every entity to spawn
+    };
+
+    struct Candidate
+    {
+        ObjectId id;
+        Priority accumulator;
+    };
+
+    void update(Connection* c, Peer& peer)
+    {
+        unsigned used = 0;
+
+        for (auto id : mDespawned) despawn(peer, id);
+
+        if (mInterest)
+        {
+            // Against the relevant set, the peer may know entities from before the interest manager
+            mInterest->update(c, mEntered, mLeft);
+            const std::vector<ObjectId>& relevant = mInterest->getRelevant(c);
+
+            mLeft.clear();
+            for (auto& e : peer.entities)
+            {
+                if (!std::binary_search(relevant.begin(), relevant.end(), e.first)) mLeft.push_back(e.first);
+            }
+            for (auto& e : peer.spawning)
+            {
+                if (!std::binary_search(relevant.begin(), relevant.end(), e.first)) mLeft.push_back(e.first);
+            }
+            for (auto id : mLeft) despawn(peer, id);
+            for (auto id : relevant) spawn(peer, id);
+        }
+        else if (peer.bNew)
+        {
+            for (auto& e : mEntities) spawn(peer, e.first);
+        }
+        else
+        {
+            for (auto id : mSpawned) spawn(peer, id);
+        }
+        peer.bNew = false;
+
+        // Despawns first, small and in order
+        std::size_t despawned = 0;
+        for (; despawned < peer.despawning.size(); despawned++)
+        {
+            beginMessage(EM_DESPAWN, peer.despawning[despawned]);
+            if (!fits(used)) break;
+            sendMessage(c, mReliableChannel, DefaultPriority, used);
+        }
+        peer.despawning.erase(peer.despawning.begin(), peer.despawning.begin() + despawned);
+
+        // Spawns
+        mCandidates.clear();
+        for (auto& s : peer.spawning)
+        {
+            s.second += mEntities[s.first]->mPriority;
+            mCandidates.push_back({s.first, s.second});
+        }
+        sortCandidates();
+
+        for (auto& candidate : mCandidates)
+        {
+            if (mBudget && used >= mBudget) break;
+
+            ReplicatedEntity* entity = mEntities[candidate.id];
+            beginMessage(EM_SPAWN, candidate.id);
+            mScratch.writeVarUint(entity->mType);
+            writeState(entity);
+            if (!fits(used)) continue; // Smaller ones may still fit
+
+            sendMessage(c, mReliableChannel, entity->mPriority, used);
+            peer.spawning.erase(candidate.id);
+            peer.entities[candidate.id] = {entity->mVariables.getSnapshot(), 0, mTick};
+        }
+
+        // Changed, or to refresh
+        mCandidates.clear();
+        for (auto& p : peer.entities)
+        {
+            ReplicatedEntity* entity = mEntities[p.first];
+            PeerEntity& state = p.second;
+
+            bool due = entity->mVariables.getSnapshot() > state.sent;
+            if (!due && entity->mMode == RM_UNRELIABLE && mRefreshInterval)
+            {
+                due = mTick - state.sentTick >= mRefreshInterval;
+            }
+            if (!due) continue;
+
+            state.accumulator += entity->mPriority;
+            mCandidates.push_back({p.first, state.accumulator});
+        }
+
+        sortCandidates();
+
+        for (auto& candidate : mCandidates)
+        {
+            if (mBudget && used >= mBudget) break;
+
+            ReplicatedEntity* entity = mEntities[candidate.id];
+            PeerEntity& state = peer.entities[candidate.id];
+
+            beginMessage(EM_UPDATE, candidate.id);
+            if (entity->mMode == RM_RELIABLE) entity->mVariables.send(mScratch, state.sent);
+            else writeState(entity);
+
+            if (!fits(used)) continue; // Smaller ones may still fit
+
+            sendMessage(c, entity->mMode == RM_RELIABLE ? mReliableChannel : mUnreliableChannel, entity->mPriority, used);
+            state.sent = entity->mVariables.getSnapshot();
+            state.accumulator = 0;
+            state.sentTick = mTick;
+        }
+    }
+
+    // Queued, sent by 'update' within the budget
+    void spawn(Peer& peer, ObjectId id)
+    {
+        if (!mEntities.count(id) || peer.entities.count(id) || peer.spawning.count(id)) return;
+        peer.spawning[id] = 0;
+
+        // Back before its despawn was sent, the spawn replaces the remote entity
+        auto it = std::find(peer.despawning.begin(), peer.despawning.end(), id);
+        if (it != peer.despawning.end()) peer.despawning.erase(it);
+    }
+
+    void despawn(Peer& peer, ObjectId id)
+    {
+        if (peer.spawning.erase(id)) return; // Never sent
+        if (peer.entities.erase(id)) peer.despawning.push_back(id);
+    }
+
+    void sortCandidates()
+    {
+        std::sort(mCandidates.begin(), mCandidates.end(), [](const Candidate& a, const Candidate& b) {
+            return a.accumulator > b.accumulator;
+        });
+    }
+
+    // The message in 'mScratch', alone if larger than the budget
+    bool fits(unsigned used) { return !mBudget || !used || used + getMessageSize() <= mBudget; }
+
+    void removeRemote(Connection* c, std::unordered_map<ObjectId, ReplicatedEntity*>& entities, ObjectId id)
+    {
+        auto it = entities.find(id);
+        if (it == entities.end()) return;
+        ReplicatedEntity* entity = it->second;
+        entities.erase(it);
+        if (mDespawnCb) mDespawnCb(c, entity);
+    }
+
+    void beginMessage(EntityMessage message, ObjectId id)
+    {
+        mScratch.clear();
+        mScratch << mHeader << byte(message);
+        mScratch.writeVarUint(id);
+    }
+
+    // Every variable, written once per snapshot
+    void writeState(ReplicatedEntity* entity)
+    {
+        uint32_t snapshot = entity->mVariables.getSnapshot();
+        if (entity->mCache.empty() || entity->mCacheSnapshot != snapshot)
+        {
+            mState.clear();
+            entity->mVariables.send(mState, 0);
+            entity->mCache.assign(mState.data().begin() + PacketHeaderSize, mState.data().begin() + mState.size());
+            entity->mCacheSnapshot = snapshot;
+        }
+        mScratch.writeBytes(entity->mCache.data(), entity->mCache.size());
+    }
+
+    std::size_t getMessageSize() { return mScratch.size() - PacketHeaderSize + sizeof(MessageSize); }
+
+    void sendMessage(Connection* c, ChannelId channel, Priority priority, unsigned& used)
+    {
+        used += getMessageSize();
+        c->sendMessage(&mScratch.data()[PacketHeaderSize], mScratch.size() - PacketHeaderSize, channel, priority);
+    }
+
+    byte mHeader;
+    ChannelId mReliableChannel;
+    ChannelId mUnreliableChannel;
+
+    ObjectId mNextId;
+    unsigned mTick;
+    unsigned mBudget;
+    unsigned mRefreshInterval;
+    InterestManager* mInterest;
+
+    SpawnCb mSpawnCb;
+    DespawnCb mDespawnCb;
+
+    // Server
+    std::unordered_map<ObjectId, ReplicatedEntity*> mEntities;
+    std::vector<ObjectId> mSpawned;   // This tick
+    std::vector<ObjectId> mDespawned; // This tick
+    std::unordered_map<Connection*, Peer> mPeers;
+
+    // Client
+    std::unordered_map<Connection*, std::unordered_map<ObjectId, ReplicatedEntity*>> mRemoteEntities;
+
+    // Reused by update
+    Buffer mScratch;
+    Buffer mState;
+    std::vector<Candidate> mCandidates;
+    std::vector<ObjectId> mEntered;
+    std::vector<ObjectId> mLeft;
+};
+
+
+} // namespace udp_network